@@ -1,5 +1,6 @@
 #include <cstring>
 #include <cstdlib>
+#include <algorithm>
 #include "acpi.hpp"
 #include "logger.hpp"
 #include "asmfunc.h"
@@ -18,6 +19,16 @@ namespace {
         }
         return sum;
     }
+
+    // ACPI Reclaim メモリを解放できるように、テーブルをカーネルのメモリに複製する
+    // 古い版のテーブルは構造体より短いことがあるので、足りない部分は 0 で埋める
+    template<typename T>
+    const T* CopyTable(const T& table) {
+        const size_t bytes = std::max<size_t>(table.header.length, sizeof(T));
+        auto copy = new uint8_t[bytes]{};
+        memcpy(copy, &table, table.header.length);
+        return reinterpret_cast<const T*>(copy);
+    }
 }
 
 namespace acpi {
@@ -67,6 +78,8 @@ namespace acpi {
     }
     unsigned long lapic_timer_freq;
     const FADT* fadt;
+    const MADT* madt;
+    const HPET* hpet;
 
     void WaitMillseconds(unsigned long msec) {
         const bool pm_timer_32 = (fadt->flags >> 8) & 1;
@@ -81,6 +94,15 @@ namespace acpi {
         while(IoIn32(fadt->pm_tmr_blk) < end);
     }
 
+    uint32_t ReadPMTimer() {
+        return IoIn32(fadt->pm_tmr_blk);
+    }
+
+    uint32_t PMTimerMask() {
+        const bool pm_timer_32 = (fadt->flags >> 8) & 1;
+        return pm_timer_32 ? 0xffffffffu : 0x00ffffffu;
+    }
+
     void Initialize(const RSDP& rsdp) {
         // RSDP構造の検証
         if(!rsdp.IsValid()) {
@@ -95,13 +117,20 @@ namespace acpi {
             exit(1);
         }
 
-        // FADTを探す
+        // FADT、MADT と HPET を探す
         fadt = nullptr;
+        madt = nullptr;
+        hpet = nullptr;
         for(int i = 0; i < xsdt.Count(); ++i) {
             const auto& entry = xsdt[i];
-            if(entry.IsValid("FACP")) {
+            if(fadt == nullptr && entry.IsValid("FACP")) {
                 fadt = reinterpret_cast<const FADT*>(&entry);
-                break;
+            }
+            else if(madt == nullptr && entry.IsValid("APIC")) {
+                madt = reinterpret_cast<const MADT*>(&entry);
+            }
+            else if(hpet == nullptr && entry.IsValid("HPET")) {
+                hpet = reinterpret_cast<const HPET*>(&entry);
             }
         }
 
@@ -109,5 +138,15 @@ namespace acpi {
             Log(kError, "FADT is not found\n");
             exit(1);
         }
+        fadt = CopyTable(*fadt);
+        if(madt) {
+            madt = CopyTable(*madt);
+        }
+        else {
+            Log(kWarn, "MADT is not found: APs are not started\n");
+        }
+        if(hpet) {
+            hpet = CopyTable(*hpet);
+        }
     }
 }
\ No newline at end of file
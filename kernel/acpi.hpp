@@ -43,10 +43,69 @@ namespace acpi {
         char reserved3[276 - 116];
     } __attribute__((packed));
     
+    struct MADT {
+        DescriptionHeader header;
+        uint32_t local_apic_address;
+        uint32_t flags;
+        // 以降に可変長のエントリが並ぶ。各エントリの先頭 2 バイトは種類と長さ
+    } __attribute__((packed));
+
+    // MADT のエントリのうち、CPU ごとの Local APIC
+    struct MADTLocalAPIC {
+        uint8_t type;    // kMADTLocalAPIC
+        uint8_t length;
+        uint8_t processor_id;
+        uint8_t apic_id;
+        uint32_t flags;  // bit 0: 有効, bit 1: 後から有効にできる
+    } __attribute__((packed));
+    const uint8_t kMADTLocalAPIC = 0;
+
+    // MADT のエントリのうち I/O APIC
+    struct MADTIOAPIC {
+        uint8_t type;    // kMADTIOAPIC
+        uint8_t length;
+        uint8_t ioapic_id;
+        uint8_t reserved;
+        uint32_t address;
+        uint32_t gsi_base; // 入力 0 番に対応する GSI
+    } __attribute__((packed));
+    const uint8_t kMADTIOAPIC = 1;
+
+    // MADT のエントリのうち、ISA の IRQ を別の GSI・極性・トリガにつなぐもの
+    struct MADTInterruptOverride {
+        uint8_t type;    // kMADTInterruptOverride
+        uint8_t length;
+        uint8_t bus;     // 0: ISA
+        uint8_t source;  // ISA の IRQ 番号
+        uint32_t gsi;
+        uint16_t flags;  // bit 0-1: 極性（3 なら Low）, bit 2-3: トリガ（3 ならレベル）。0 は ISA の既定
+    } __attribute__((packed));
+    const uint8_t kMADTInterruptOverride = 2;
+
+    // High Precision Event Timer の記述表
+    struct HPET {
+        DescriptionHeader header;
+        uint32_t event_timer_block_id;
+        uint8_t address_space_id; // 0: メモリ空間
+        uint8_t register_bit_width;
+        uint8_t register_bit_offset;
+        uint8_t reserved;
+        uint64_t address;
+        uint8_t hpet_number;
+        uint16_t minimum_tick;
+        uint8_t page_protection;
+    } __attribute__((packed));
+
     extern const FADT* fadt;
+    extern const MADT* madt;  // 見つからなければ nullptr
+    extern const HPET* hpet;  // 見つからなければ nullptr
     const int kPMTimerFreq = 3579545;  // Hz(1秒間に振動する回数)
 
     void WaitMillseconds(unsigned long msec);
+    // PM タイマの現在値。24 ビットのタイマなら上位 8 ビットは 0
+    uint32_t ReadPMTimer();
+    // PM タイマの有効なビットのマスク（差を取ったらこれでマスクする）
+    uint32_t PMTimerMask();
     void Initialize(const RSDP& rsdp);
 } // namespace acpi
 
@@ -66,6 +66,34 @@ SetCSSS:
     pop rbp
     ret
 
+global LoadTR  ; void LoadTR(uint16_t sel);
+LoadTR:
+    ltr di
+    ret
+
+global GetCR2  ; uint64_t GetCR2();
+GetCR2:
+    mov rax, cr2
+    ret
+
+global GetCR0  ; uint64_t GetCR0();
+GetCR0:
+    mov rax, cr0
+    ret
+
+global SetCR0  ; void SetCR0(uint64_t value);
+SetCR0:
+    mov cr0, rdi
+    ret
+
+global SetXCR0  ; void SetXCR0(uint64_t value);
+SetXCR0:
+    mov rax, rdi
+    mov rdx, rdi
+    shr rdx, 32
+    xor ecx, ecx
+    xsetbv
+    ret
 
 global SetCR3  ; void SetCR3(uint64_t value);
 SetCR3:
@@ -77,6 +105,65 @@ GetCR3:
     mov rax, cr3
     ret
 
+global SetCR4  ; void SetCR4(uint64_t value);
+SetCR4:
+    mov cr4, rdi
+    ret
+
+global GetCR4  ; uint64_t GetCR4();
+GetCR4:
+    mov rax, cr4
+    ret
+
+global InvalidateTLB  ; void InvalidateTLB(uint64_t addr);
+InvalidateTLB:
+    invlpg [rdi]
+    ret
+
+global ReadCPUID  ; void ReadCPUID(uint32_t eax, uint32_t ecx, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d);
+ReadCPUID:
+    push rbx   ; cpuid は rbx を書き換える
+    mov r10, rdx
+    mov r11, rcx
+    mov eax, edi
+    mov ecx, esi
+    cpuid
+    mov [r10], eax
+    mov [r11], ebx
+    mov [r8], ecx
+    mov [r9], edx
+    pop rbx
+    ret
+
+global ReadMSR  ; uint64_t ReadMSR(uint32_t msr);
+ReadMSR:
+    mov ecx, edi
+    rdmsr
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global WriteMSR  ; void WriteMSR(uint32_t msr, uint64_t value);
+WriteMSR:
+    mov ecx, edi
+    mov eax, esi
+    mov rdx, rsi
+    shr rdx, 32
+    wrmsr
+    ret
+
+global ReadTSC  ; uint64_t ReadTSC();
+ReadTSC:
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global FlushCache  ; void FlushCache();
+FlushCache:
+    wbinvd
+    ret
+
 global SwitchContext
 SwitchContext:   ; void SwitchContext(void* next_ctx, void* current_ctx)
     ; レジスタの保存
@@ -100,8 +187,7 @@ SwitchContext:   ; void SwitchContext(void* next_ctx, void* current_ctx)
     mov [rsi + 0xb0], r14
     mov [rsi + 0xb8], r15
 
-    mov rax, cr3
-    mov [rsi + 0x00], rax  
+    ; CR3 はタスクごとに固定なので保存しない（PCID の no-flush ビットを残すため）
     mov rax, [rsp]
     mov [rsi + 0x08], rax  
     pushfq
@@ -116,7 +202,23 @@ SwitchContext:   ; void SwitchContext(void* next_ctx, void* current_ctx)
     mov dx, gs
     mov [rsi + 0x38], rdx
 
-    fxsave [rsi + 0xc0]    
+    ; FPU を使っていれば（CR0.TS が落ちていれば）状態を保存して TS を立てる。
+    ; 次のタスクの状態は、そのタスクが FPU を使ったときに #NM ハンドラが復元する
+    mov rcx, cr0
+    test rcx, 8
+    jnz .fpu_saved
+    cmp byte [fpu_xsave_enabled], 0
+    je .fxsave
+    mov eax, 0xffffffff
+    mov edx, 0xffffffff
+    xsaveopt [rsi + 0xc0]
+    jmp .set_ts
+.fxsave:
+    fxsave [rsi + 0xc0]
+.set_ts:
+    or rcx, 8
+    mov cr0, rcx
+.fpu_saved:
 
     ; iret用のスタックを構築
     push qword [rdi + 0x28]  ; SS
@@ -125,11 +227,16 @@ SwitchContext:   ; void SwitchContext(void* next_ctx, void* current_ctx)
     push qword [rdi + 0x20]  ; CS
     push qword [rdi + 0x08]  ; RIP
 
-    ; レジスタの復元    
-    fxrstor [rdi + 0xc0]
-
+    ; レジスタの復元
+    ; 同じアドレス空間なら CR3 を再ロードしない（bit 63 は no-flush で読み出せない）
     mov rax, [rdi + 0x00]
+    mov rcx, rax
+    btr rcx, 63
+    mov rdx, cr3
+    cmp rcx, rdx
+    je .cr3_unchanged
     mov cr3, rax
+.cr3_unchanged:
     mov rax, [rdi + 0x30]
     mov fs, ax
     mov rax, [rdi + 0x38]
@@ -153,6 +260,47 @@ SwitchContext:   ; void SwitchContext(void* next_ctx, void* current_ctx)
     mov rdi, [rdi + 0x60]  ; rdiは最後に復元
     o64 iret
 
+extern fpu_xsave_enabled
+extern CurrentFPUArea
+
+global IntHandlerDeviceNotAvailable  ; #NM（CR0.TS が立った状態で FPU を使った）
+IntHandlerDeviceNotAvailable:
+    ; 呼び出し側保存のレジスタを退避する（9 個積むと rsp は 16 バイト境界になる）
+    push rax
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push r8
+    push r9
+    push r10
+    push r11
+
+    ; FPU のレジスタは前のタスクが SwitchContext で保存済みなので、上書きしてよい
+    clts
+    call CurrentFPUArea  ; uint8_t* CurrentFPUArea();
+    cmp byte [fpu_xsave_enabled], 0
+    je .fxrstor
+    mov rcx, rax
+    mov eax, 0xffffffff
+    mov edx, 0xffffffff
+    xrstor [rcx]
+    jmp .restored
+.fxrstor:
+    fxrstor [rax]
+.restored:
+
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rax
+    o64 iret
+
 extern kernel_main_stack
 extern KernelMainNewStack
 
@@ -164,3 +312,90 @@ KernelMain:
     hlt
     jmp .fin
 
+; Application Processor の起動コード
+; 1 MiB 未満のページにコピーされ、SIPI を受けた AP が実モードで実行を始める。
+; どのページに置かれても動くよう、先頭のリニアアドレスを CS から求めて使う。
+bits 16
+global APTrampoline  ; 起動コードの先頭
+APTrampoline:
+    cli
+    mov ax, cs
+    mov ds, ax
+    mov ss, ax
+    mov sp, 0x1000  ; ページの末尾をスタックにする
+    xor ebx, ebx
+    mov bx, ax
+    shl ebx, 4      ; ebx = 起動コードのリニアアドレス
+
+    mov eax, ebx
+    add eax, ap_gdt - APTrampoline
+    mov [ap_gdtr - APTrampoline + 2], eax
+    lgdt [ap_gdtr - APTrampoline]
+
+    mov eax, cr0
+    or eax, 1       ; 保護モード
+    mov cr0, eax
+    mov eax, ebx
+    add eax, .protected_mode - APTrampoline
+    push dword 0x08 ; 32 ビットコードセグメント
+    push eax
+    o32 retf
+
+bits 32
+.protected_mode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    lea esp, [ebx + 0x1000]
+
+    mov eax, [ebx + ap_cr4 - APTrampoline]  ; PAE を含む
+    mov cr4, eax
+    mov eax, [ebx + ap_cr3 - APTrampoline]
+    mov cr3, eax
+    mov ecx, 0xc0000080  ; IA32_EFER
+    mov eax, [ebx + ap_efer - APTrampoline]  ; LME を含む
+    xor edx, edx
+    wrmsr
+    mov eax, [ebx + ap_cr0 - APTrampoline]   ; ページングを有効にすると IA-32e モードに入る
+    mov cr0, eax
+
+    mov eax, ebx
+    add eax, .long_mode - APTrampoline
+    push 0x18       ; 64 ビットコードセグメント
+    push eax
+    retf
+
+bits 64
+.long_mode:
+    mov ebx, ebx    ; 上位 32 ビットは不定なので 0 にする
+    mov rsp, [rbx + ap_stack - APTrampoline]
+    mov rdi, [rbx + ap_arg - APTrampoline]
+    call [rbx + ap_entry - APTrampoline]
+.fin:
+    hlt
+    jmp .fin
+
+align 8
+ap_gdt:
+    dq 0
+    dq 0x00cf9a000000ffff  ; 0x08: 32 ビットコード
+    dq 0x00cf92000000ffff  ; 0x10: データ
+    dq 0x00af9a000000ffff  ; 0x18: 64 ビットコード
+ap_gdtr:
+    dw 4 * 8 - 1
+    dd 0            ; 起動時にリニアアドレスを書き込む
+
+align 8
+global APTrampolineParams  ; BSP が書き込む起動パラメータ（smp.cpp の APBootParams）
+APTrampolineParams:
+ap_cr0:   dq 0
+ap_cr3:   dq 0
+ap_cr4:   dq 0
+ap_efer:  dq 0
+ap_stack: dq 0
+ap_entry: dq 0
+ap_arg:   dq 0
+
+global APTrampolineEnd
+APTrampolineEnd:
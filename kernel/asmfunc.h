@@ -9,8 +9,25 @@ extern "C" {
     void LoadGDT(uint16_t limit, uint64_t offset);
     void SetCSSS(uint16_t cs, uint16_t ss);
     void SetDSAll(uint16_t value);
+    void LoadTR(uint16_t sel);
+    uint64_t GetCR0();
+    void SetCR0(uint64_t value);
+    void SetXCR0(uint64_t value);
     void SetCR3(uint64_t value);
+    uint64_t GetCR2();
     uint64_t GetCR3();
+    void SetCR4(uint64_t value);
+    uint64_t GetCR4();
+    void InvalidateTLB(uint64_t addr);
+    void ReadCPUID(uint32_t eax, uint32_t ecx,
+                   uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d);
+    uint64_t ReadMSR(uint32_t msr);
+    void WriteMSR(uint32_t msr, uint64_t value);
+    uint64_t ReadTSC();
+    void FlushCache();
     void SwitchContext(void* next_ctx, void* current_ctx);
+    void IntHandlerDeviceNotAvailable();
+    // AP の起動コード。1 MiB 未満のページにコピーして使う
+    extern uint8_t APTrampoline[], APTrampolineParams[], APTrampolineEnd[];
 }
 
@@ -0,0 +1,258 @@
+#include <cstring>
+#include <algorithm>
+#include "buddy_memory_manager.hpp"
+
+namespace {
+    size_t MapWords(size_t frame_count, int order) {
+        return (frame_count >> order) / 64 + 1;
+    }
+
+    // Smallest order whose block can hold num_frames.
+    int OrderOf(size_t num_frames) {
+        int order = 0;
+        while((static_cast<size_t>(1) << order) < num_frames) {
+            ++order;
+        }
+        return order;
+    }
+}
+
+BuddyMemoryManager::BuddyMemoryManager()
+    : free_lists_{}, free_counts_{}, free_maps_{}, frame_count_{0} {
+}
+
+Error BuddyMemoryManager::Initialize(const MemoryMap& memory_map) {
+    const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
+    const auto for_each_descriptor = [&](auto f) {
+        for(uintptr_t iter = memory_map_base; iter < memory_map_base + memory_map.map_size;
+            iter += memory_map.descriptor_size) {
+            f(*reinterpret_cast<const MemoryDescriptor*>(iter));
+        }
+    };
+
+    uintptr_t available_end = 0;
+    for_each_descriptor([&](const MemoryDescriptor& desc) {
+        if(IsAvailable(static_cast<MemoryType>(desc.type)) ||
+           static_cast<MemoryType>(desc.type) == MemoryType::kEfiACPIReclaimMemory) {
+            available_end = std::max(available_end,
+                desc.physical_start + desc.number_of_pages * kUEFIPageSize);
+        }
+    });
+    frame_count_ = available_end / kBytesPerFrame;
+
+    size_t map_bytes = 0;
+    for(int order = 0; order <= kMaxOrder; ++order) {
+        map_bytes += MapWords(frame_count_, order) * sizeof(uint64_t);
+    }
+    const size_t map_frames = (map_bytes + kBytesPerFrame - 1) / kBytesPerFrame;
+
+    // 空き領域の先頭をビットマップの置き場所にする
+    uintptr_t map_base = 0;
+    for_each_descriptor([&](const MemoryDescriptor& desc) {
+        if(map_base == 0 && desc.physical_start >= kLowMemoryEnd &&
+           desc.type == MemoryType::kEfiConventionalMemory &&
+           desc.number_of_pages * kUEFIPageSize >= map_frames * kBytesPerFrame) {
+            map_base = desc.physical_start;
+        }
+    });
+    if(map_base == 0) {
+        return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
+
+    memset(reinterpret_cast<void*>(map_base), 0, map_frames * kBytesPerFrame);
+    auto map = reinterpret_cast<uint64_t*>(map_base);
+    for(int order = 0; order <= kMaxOrder; ++order) {
+        free_maps_[order] = map;
+        map += MapWords(frame_count_, order);
+    }
+
+    const size_t map_frame_begin = map_base / kBytesPerFrame;
+    const size_t map_frame_end = map_frame_begin + map_frames;
+    for_each_descriptor([&](const MemoryDescriptor& desc) {
+        // ブートサービスの領域は ReleaseBootServicesMemory で後から解放される
+        if(static_cast<MemoryType>(desc.type) != MemoryType::kEfiConventionalMemory) {
+            return;
+        }
+        size_t begin = std::max<size_t>(desc.physical_start / kBytesPerFrame,
+                                        kLowMemoryEnd / kBytesPerFrame);
+        size_t end = (desc.physical_start + desc.number_of_pages * kUEFIPageSize) / kBytesPerFrame;
+        if(begin >= end) {
+            return;
+        }
+        if(begin < map_frame_begin) {
+            FreeRange(begin, std::min(end, map_frame_begin) - begin);
+        }
+        begin = std::max(begin, map_frame_end);
+        if(begin < end) {
+            FreeRange(begin, end - begin);
+        }
+    });
+
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+bool BuddyMemoryManager::IsFree(size_t frame, int order) const {
+    if(frame + (static_cast<size_t>(1) << order) > frame_count_) {
+        return false;
+    }
+    const auto index = frame >> order;
+    return (free_maps_[order][index / 64] >> (index % 64)) & 1;
+}
+
+void BuddyMemoryManager::Push(size_t frame, int order) {
+    auto block = reinterpret_cast<FreeBlock*>(FrameID{frame}.Frame());
+    block->prev = nullptr;
+    block->next = free_lists_[order];
+    if(block->next) {
+        block->next->prev = block;
+    }
+    free_lists_[order] = block;
+    ++free_counts_[order];
+
+    const auto index = frame >> order;
+    free_maps_[order][index / 64] |= static_cast<uint64_t>(1) << (index % 64);
+}
+
+void BuddyMemoryManager::Remove(size_t frame, int order) {
+    auto block = reinterpret_cast<FreeBlock*>(FrameID{frame}.Frame());
+    if(block->prev) {
+        block->prev->next = block->next;
+    }
+    else {
+        free_lists_[order] = block->next;
+    }
+    if(block->next) {
+        block->next->prev = block->prev;
+    }
+    --free_counts_[order];
+
+    const auto index = frame >> order;
+    free_maps_[order][index / 64] &= ~(static_cast<uint64_t>(1) << (index % 64));
+}
+
+// バディが空いていれば結合してから空きリストに戻す
+void BuddyMemoryManager::FreeBlockAndMerge(size_t frame, int order) {
+    while(order < kMaxOrder) {
+        const size_t buddy = frame ^ (static_cast<size_t>(1) << order);
+        if(!IsFree(buddy, order)) {
+            break;
+        }
+        Remove(buddy, order);
+        frame &= ~(static_cast<size_t>(1) << order);
+        ++order;
+    }
+    Push(frame, order);
+}
+
+// 任意の範囲を、アラインされた最大のブロックに分割して解放
+void BuddyMemoryManager::FreeRange(size_t frame, size_t num_frames) {
+    while(num_frames > 0) {
+        int order = frame == 0 ? kMaxOrder : std::min(__builtin_ctzl(frame), kMaxOrder);
+        while((static_cast<size_t>(1) << order) > num_frames) {
+            --order;
+        }
+        FreeBlockAndMerge(frame, order);
+        frame += static_cast<size_t>(1) << order;
+        num_frames -= static_cast<size_t>(1) << order;
+    }
+}
+
+// lock_ を取った状態で呼ぶ。最大のブロックが連続して空いているところを、
+// 最上位のビットマップから線形に探す（画面サイズのバッファなど、まれにしか来ない）
+WithError<FrameID> BuddyMemoryManager::AllocateLarge(size_t num_frames) {
+    const size_t blocks = (num_frames + kMaxBlockFrames - 1) >> kMaxOrder;
+    const size_t total_blocks = frame_count_ >> kMaxOrder;
+    const uint64_t* map = free_maps_[kMaxOrder];
+    size_t run = 0;
+    for(size_t index = 0; index < total_blocks; ++index) {
+        if(index % 64 == 0 && map[index / 64] == 0) { // 64 ブロック分まとめて飛ばす
+            run = 0;
+            index += 63;
+            continue;
+        }
+        if(((map[index / 64] >> (index % 64)) & 1) == 0) {
+            run = 0;
+            continue;
+        }
+        if(++run < blocks) {
+            continue;
+        }
+
+        const size_t first = index + 1 - blocks;
+        for(size_t i = first; i <= index; ++i) {
+            Remove(i << kMaxOrder, kMaxOrder);
+        }
+        const size_t frame = first << kMaxOrder;
+        FreeRange(frame + num_frames, (blocks << kMaxOrder) - num_frames);
+        return {FrameID{frame}, MAKE_ERROR(Error::kSuccess)};
+    }
+    return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+}
+
+WithError<FrameID> BuddyMemoryManager::Allocate(size_t num_frames) {
+    SpinLockGuard guard{lock_};
+    if(num_frames == 0) {
+        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+    if(num_frames > kMaxBlockFrames) {
+        return AllocateLarge(num_frames);
+    }
+
+    const int order = OrderOf(num_frames);
+    int found = order;
+    while(found <= kMaxOrder && free_lists_[found] == nullptr) {
+        ++found;
+    }
+    if(found > kMaxOrder) {
+        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    const size_t frame = reinterpret_cast<uintptr_t>(free_lists_[found]) / kBytesPerFrame;
+    Remove(frame, found);
+    // 余った後半を1段ずつ空きリストに戻す
+    while(found > order) {
+        --found;
+        Push(frame + (static_cast<size_t>(1) << found), found);
+    }
+    // 2のべき乗に満たない分は返却する
+    FreeRange(frame + num_frames, (static_cast<size_t>(1) << order) - num_frames);
+
+    return {FrameID{frame}, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error BuddyMemoryManager::Free(FrameID start_frame, size_t num_frames) {
+    SpinLockGuard guard{lock_};
+    if(start_frame.ID() + num_frames > frame_count_) {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    FreeRange(start_frame.ID(), num_frames);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void BuddyMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames) {
+    SpinLockGuard guard{lock_};
+    const size_t end = std::min(start_frame.ID() + num_frames, frame_count_);
+    size_t frame = start_frame.ID();
+    while(frame < end) {
+        // frame を含む空きブロックを探す
+        int order = 0;
+        size_t block = frame;
+        for(; order <= kMaxOrder; ++order) {
+            block = frame & ~((static_cast<size_t>(1) << order) - 1);
+            if(IsFree(block, order)) {
+                break;
+            }
+        }
+        if(order > kMaxOrder) { // already allocated
+            ++frame;
+            continue;
+        }
+
+        const size_t block_end = block + (static_cast<size_t>(1) << order);
+        const size_t cut_end = std::min(block_end, end);
+        Remove(block, order);
+        FreeRange(block, frame - block);
+        FreeRange(cut_end, block_end - cut_end);
+        frame = cut_end;
+    }
+}
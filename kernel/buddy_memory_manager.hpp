@@ -0,0 +1,45 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include "memory_manager.hpp"
+
+// Buddy-system frame allocator.
+// Blocks of 2^order frames (order 0: 4 KiB ... kMaxOrder: 2 MiB) are kept in
+// per-order free lists. The list nodes live in the free frames themselves,
+// and a bitmap per order tells whether a block is on its free list.
+// Larger requests take a run of adjacent free blocks of kMaxOrder.
+class BuddyMemoryManager : public MemoryManager {
+    public:
+        static constexpr int kMaxOrder = 9;
+        static constexpr size_t kMaxBlockFrames = static_cast<size_t>(1) << kMaxOrder;
+
+        BuddyMemoryManager();
+
+        // Build the free lists from the available descriptors of the UEFI memory map.
+        Error Initialize(const MemoryMap& memory_map);
+
+        WithError<FrameID> Allocate(size_t num_frames) override;
+        Error Free(FrameID start_frame, size_t num_frames) override;
+        void MarkAllocated(FrameID start_frame, size_t num_frames) override;
+
+        // Number of free blocks of the specified order.
+        size_t FreeBlocks(int order) const { return free_counts_[order]; }
+
+    private:
+        struct FreeBlock {
+            FreeBlock* prev;
+            FreeBlock* next;
+        };
+
+        std::array<FreeBlock*, kMaxOrder + 1> free_lists_;
+        std::array<size_t, kMaxOrder + 1> free_counts_;
+        std::array<uint64_t*, kMaxOrder + 1> free_maps_;  // 1bit == 1 block of the order
+        size_t frame_count_;
+
+        bool IsFree(size_t frame, int order) const;
+        void Push(size_t frame, int order);
+        void Remove(size_t frame, int order);
+        void FreeBlockAndMerge(size_t frame, int order);
+        void FreeRange(size_t frame, size_t num_frames);
+        WithError<FrameID> AllocateLarge(size_t num_frames);
+};
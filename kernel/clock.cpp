@@ -0,0 +1,173 @@
+#include <array>
+#include <atomic>
+#include <limits>
+#include "clock.hpp"
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "hpet.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "smp.hpp"
+
+unsigned long tsc_freq;
+
+namespace {
+    const uint32_t kIA32TSCAux = 0xc0000103;
+    const unsigned long kCalibrationMsec = 100;     // PM タイマ（3.58 MHz、24 ビットのこともある）
+    const unsigned long kHPETCalibrationMsec = 10;  // HPET は分解能が高いので短くてよい
+    const int kSyncRounds = 16;
+    const uint32_t kSyncDone = std::numeric_limits<uint32_t>::max();
+
+    uint64_t tsc_base;
+    uint64_t ns_mult; // ns = (tsc * ns_mult) >> 32
+    bool tsc_invariant = false;
+    bool use_rdtscp = false;    // IA32_TSC_AUX に CPU のインデックスを入れてある
+    bool need_offsets = false;  // 0 でないオフセットがある
+    std::array<int64_t, kMaxCPUs> offsets{};
+
+    // AP が sync_seq を奇数にしたら、BSP が sync_tsc に自分の TSC を書いて偶数にする
+    std::atomic<uint32_t> sync_seq{0};
+    std::atomic<uint64_t> sync_tsc{0};
+
+    bool HasCPUIDBit(uint32_t leaf, int reg, int bit) {
+        uint32_t regs[4];
+        ReadCPUID(leaf & 0x80000000u, 0, &regs[0], &regs[1], &regs[2], &regs[3]);
+        if(regs[0] < leaf) {
+            return false;
+        }
+        ReadCPUID(leaf, 0, &regs[0], &regs[1], &regs[2], &regs[3]);
+        return (regs[reg] >> bit) & 1;
+    }
+
+    // PM タイマの値が変わった瞬間から測り始め、変わった瞬間に止める
+    unsigned long CalibrateWithPMTimer() {
+        const uint32_t mask = acpi::PMTimerMask();
+        const uint32_t target = acpi::kPMTimerFreq * kCalibrationMsec / 1000;
+        uint32_t pm_start = acpi::ReadPMTimer();
+        while(acpi::ReadPMTimer() == pm_start);
+        const uint64_t tsc_start = ReadTSC();
+        pm_start = acpi::ReadPMTimer();
+        uint32_t pm_elapsed;
+        do {
+            pm_elapsed = (acpi::ReadPMTimer() - pm_start) & mask;
+        } while(pm_elapsed < target);
+        const uint64_t tsc_elapsed = ReadTSC() - tsc_start;
+
+        return tsc_elapsed * acpi::kPMTimerFreq / pm_elapsed;
+    }
+
+    // HPET のカウンタを読む前後の TSC の中間を、その値を読んだ時刻とみなす
+    void ReadHPETAndTSC(uint64_t& counter, uint64_t& tsc) {
+        const uint64_t before = ReadTSC();
+        counter = ReadHPETCounter();
+        tsc = before + (ReadTSC() - before) / 2;
+    }
+
+    unsigned long CalibrateWithHPET() {
+        const uint64_t target = hpet_freq * kHPETCalibrationMsec / 1000;
+        uint64_t hpet_start, tsc_start, hpet_end, tsc_end;
+        ReadHPETAndTSC(hpet_start, tsc_start);
+        do {
+            ReadHPETAndTSC(hpet_end, tsc_end);
+        } while(hpet_end - hpet_start < target);
+
+        return static_cast<unsigned __int128>(tsc_end - tsc_start) * hpet_freq
+            / (hpet_end - hpet_start);
+    }
+}
+
+uint64_t ClockTSC() {
+    if(use_rdtscp) {
+        unsigned int cpu;
+        const uint64_t tsc = __builtin_ia32_rdtscp(&cpu); // TSC と CPU を同時に読む
+        return tsc + offsets[cpu];
+    }
+    if(!need_offsets) {
+        return ReadTSC();
+    }
+    InterruptGuard guard; // 読んでいる間に他の CPU に移らないように
+    return ReadTSC() + offsets[CurrentCPU()];
+}
+
+uint64_t TSCToNanoseconds(uint64_t tsc_delta) {
+    return (static_cast<unsigned __int128>(tsc_delta) * ns_mult) >> 32;
+}
+
+uint64_t NowNanoseconds() {
+    return TSCToNanoseconds(ClockTSC() - tsc_base);
+}
+
+bool TSCInvariant() {
+    return tsc_invariant;
+}
+
+int64_t ClockOffset(int cpu) {
+    return offsets[cpu];
+}
+
+void InitializeClock() {
+    tsc_invariant = HasCPUIDBit(0x80000007, 3, 8);
+    use_rdtscp = HasCPUIDBit(0x80000001, 3, 27);
+    if(use_rdtscp) {
+        WriteMSR(kIA32TSCAux, 0);
+    }
+    if(!tsc_invariant) {
+        Log(kWarn, "TSC is not invariant: the clock drifts if the CPU frequency changes\n");
+    }
+
+    const bool use_hpet = HPETAvailable();
+    tsc_freq = use_hpet ? CalibrateWithHPET() : CalibrateWithPMTimer();
+    ns_mult = (static_cast<uint64_t>(1000000000) << 32) / tsc_freq;
+    tsc_base = ReadTSC();
+    Log(kInfo, "TSC: %lu kHz%s, calibrated against %s\n", tsc_freq / 1000,
+        tsc_invariant ? " (invariant)" : "", use_hpet ? "HPET" : "PM timer");
+}
+
+void InitializeClockAP(int cpu) {
+    if(use_rdtscp) {
+        WriteMSR(kIA32TSCAux, cpu);
+    }
+
+    // 往復が一番短かった回の、行きと帰りの中間を BSP の TSC を読んだ時刻とみなす
+    uint64_t best_rtt = std::numeric_limits<uint64_t>::max();
+    int64_t offset = 0;
+    for(uint32_t round = 0; round < kSyncRounds; ++round) {
+        const uint64_t t0 = ReadTSC();
+        sync_seq.store(2 * round + 1, std::memory_order_release);
+        while(sync_seq.load(std::memory_order_acquire) != 2 * round + 2) {
+            __builtin_ia32_pause();
+        }
+        const uint64_t t1 = ReadTSC();
+        const uint64_t bsp_tsc = sync_tsc.load(std::memory_order_relaxed);
+        if(t1 - t0 < best_rtt) {
+            best_rtt = t1 - t0;
+            offset = static_cast<int64_t>(bsp_tsc - (t0 + (t1 - t0) / 2));
+        }
+    }
+    offsets[cpu] = offset;
+    // 往復の半分より小さいずれは測れないので、補正しない
+    if(offset > static_cast<int64_t>(best_rtt / 2) || -offset > static_cast<int64_t>(best_rtt / 2)) {
+        need_offsets = true;
+    }
+    else {
+        offsets[cpu] = 0;
+    }
+    sync_seq.store(kSyncDone, std::memory_order_release);
+}
+
+bool SyncClockWithAP(int cpu) {
+    const uint64_t deadline = ReadTSC() + tsc_freq / 10; // 100 ミリ秒
+    while(ReadTSC() < deadline) {
+        const uint32_t seq = sync_seq.load(std::memory_order_acquire);
+        if(seq == kSyncDone) {
+            sync_seq.store(0, std::memory_order_relaxed); // 次の AP のため
+            return true;
+        }
+        if(seq & 1) {
+            sync_tsc.store(ReadTSC(), std::memory_order_relaxed);
+            sync_seq.store(seq + 1, std::memory_order_release);
+        }
+    }
+    sync_seq.store(0, std::memory_order_relaxed); // AP は INIT で止められる
+    return false;
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <cstdint>
+
+// TSC を元にした単調増加の時刻。読むのは RDTSC(P) だけで、MMIO も I/O ポートも読まない。
+// AP の TSC は起動時に BSP と突き合わせ、ずれを CPU ごとのオフセットで補正する
+
+extern unsigned long tsc_freq; // TSC の 1 秒間あたりのカウント数
+
+// 起動（InitializeClock）からのナノ秒
+uint64_t NowNanoseconds();
+// オフセットを補正した TSC。差を取るだけなら ReadTSC より少し高い
+uint64_t ClockTSC();
+uint64_t TSCToNanoseconds(uint64_t tsc_delta);
+
+// TSC が CPU の周波数や省電力状態によらず一定の速さで進む（CPUID 0x80000007 EDX bit 8）
+bool TSCInvariant();
+// CPU の TSC に足すと BSP の TSC になる値
+int64_t ClockOffset(int cpu);
+
+// ACPI PM タイマで TSC の周波数を測る。acpi::Initialize の後、BSP で呼ぶ
+void InitializeClock();
+// AP 側：起動したらすぐ呼び、BSP の SyncClockWithAP と TSC を突き合わせる
+void InitializeClockAP(int cpu);
+// BSP 側：AP を起動した直後に呼ぶ。AP が突き合わせを終えたら true
+bool SyncClockWithAP(int cpu);
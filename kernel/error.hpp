@@ -27,6 +27,8 @@ class Error {
             kNoPCIMSI,
             kUnknownPixelFormat,
             kNoSuchTask,
+            kStackOverflow,
+            kNoSuchTimer,
             kLastOfCode,  // always last elem
         };
 
@@ -49,7 +51,7 @@ class Error {
         }
 
     private:
-        static constexpr std::array<const char*, 20> code_names_ = {
+        static constexpr std::array<const char*, kLastOfCode> code_names_ = {
             "kSuccess",
             "kFull",
             "kEmpty",
@@ -70,6 +72,11 @@ class Error {
             "kInvalidPhase",
             "kUnknownXHCISpeedID",
             "kNoWaiter",
+            "kNoPCIMSI",
+            "kUnknownPixelFormat",
+            "kNoSuchTask",
+            "kStackOverflow",
+            "kNoSuchTimer",
         };
 
         Code code_;
@@ -1,7 +1,9 @@
 #include "fat.hpp"
 
+#include <algorithm>
 #include <cstring>
 #include <locale>
+#include "memory_manager.hpp"
 
 namespace fat {
     BPB* boot_volume_image;
@@ -78,5 +80,42 @@ namespace fat {
         return nullptr;
     }
 
+    size_t ReleaseUnusedRegions() {
+        const auto image = reinterpret_cast<uintptr_t>(boot_volume_image);
+        const unsigned long bytes_per_sector = boot_volume_image->bytes_per_sector;
+        const unsigned long total_sectors = boot_volume_image->total_sectors_32 ?
+            boot_volume_image->total_sectors_32 : boot_volume_image->total_sectors_16;
+        const uintptr_t image_end = image + std::min<size_t>(
+            total_sectors * bytes_per_sector, kMaxVolumeImageBytes);
 
+        // 2つ目以降の FAT は読まない
+        const uintptr_t fat_bytes = static_cast<uintptr_t>(boot_volume_image->fat_size_32) * bytes_per_sector;
+        const uintptr_t second_fat = image + boot_volume_image->reserved_sector_count * bytes_per_sector + fat_bytes;
+        size_t frames = ReclaimMemory(second_fat,
+            std::min(second_fat + (boot_volume_image->num_fats - 1) * fat_bytes, image_end));
+
+        // 空きクラスタの連続した範囲ごとに解放する
+        const unsigned long data_sectors = total_sectors - boot_volume_image->reserved_sector_count -
+            boot_volume_image->num_fats * boot_volume_image->fat_size_32;
+        const unsigned long end_cluster = data_sectors / boot_volume_image->sectors_per_cluster + 2;
+        const uintptr_t fat_offset = boot_volume_image->reserved_sector_count * bytes_per_sector;
+        const uint32_t* fat = reinterpret_cast<const uint32_t*>(image + fat_offset);
+        unsigned long cluster = 2;
+        while (cluster < end_cluster) {
+            if ((fat[cluster] & 0x0fffffffu) != 0) {
+                ++cluster;
+                continue;
+            }
+            const unsigned long run_begin = cluster;
+            while (cluster < end_cluster && (fat[cluster] & 0x0fffffffu) == 0) {
+                ++cluster;
+            }
+            const uintptr_t begin = GetClusterAddr(run_begin);
+            if (begin >= image_end) {
+                break;
+            }
+            frames += ReclaimMemory(begin, std::min(GetClusterAddr(cluster), image_end));
+        }
+        return frames;
+    }
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 
 namespace fat {
@@ -84,4 +85,11 @@ namespace fat {
     bool NameIsEqual(const DirectoryEntry& entry, const char* name);
 
     DirectoryEntry* FindFile(const char* name, unsigned long directory_cluster = 0);
+
+    // ブートローダが読み込むボリュームイメージの上限 (MikanLoaderPkg/Main.c)
+    static const size_t kMaxVolumeImageBytes = 16 * 1024 * 1024;
+
+    // 読み込み専用なので、空きクラスタと予備の FAT が占めるフレームは不要
+    // 解放したフレーム数を返す
+    size_t ReleaseUnusedRegions();
 }
\ No newline at end of file
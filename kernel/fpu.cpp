@@ -0,0 +1,71 @@
+#include <atomic>
+#include <cstring>
+#include "fpu.hpp"
+#include "asmfunc.h"
+#include "logger.hpp"
+#include "smp.hpp"
+#include "task.hpp"
+
+namespace {
+    const uint64_t kCR0MP = 1u << 1;
+    const uint64_t kCR0EM = 1u << 2;
+    const uint64_t kCR4OSFXSR = 1u << 9;
+    const uint64_t kCR4OSXMMEXCPT = 1u << 10;
+    const uint64_t kCR4OSXSAVE = 1u << 18;
+
+    const uint64_t kXCR0X87 = 1u << 0;
+    const uint64_t kXCR0SSE = 1u << 1;
+    const uint64_t kXCR0AVX = 1u << 2;
+
+    std::atomic<size_t> fpu_traps{0};
+}
+
+extern "C" {
+    uint8_t fpu_xsave_enabled = 0;
+
+    uint8_t* CurrentFPUArea() {
+        fpu_traps.fetch_add(1, std::memory_order_relaxed);
+        return task_manager->CurrentTask().Context().fpu_area.data();
+    }
+}
+
+void InitializeFPU() {
+    SetCR0((GetCR0() | kCR0MP) & ~kCR0EM); // TS が立っていれば FWAIT も #NM にする
+    SetCR4(GetCR4() | kCR4OSFXSR | kCR4OSXMMEXCPT);
+
+    uint32_t eax, ebx, ecx, edx;
+    ReadCPUID(1, 0, &eax, &ebx, &ecx, &edx);
+    const bool xsave = ecx & (1u << 26);
+    const bool avx = ecx & (1u << 28);
+    if(!xsave) {
+        return;
+    }
+    ReadCPUID(0xd, 1, &eax, &ebx, &ecx, &edx);
+    if((eax & 1) == 0) { // XSAVEOPT
+        return;
+    }
+
+    SetCR4(GetCR4() | kCR4OSXSAVE);
+    SetXCR0(kXCR0X87 | kXCR0SSE | (avx ? kXCR0AVX : 0));
+    ReadCPUID(0xd, 0, &eax, &ebx, &ecx, &edx); // ebx: 今の XCR0 で必要な大きさ
+    if(ebx > kFPUAreaBytes) {
+        Log(kWarn, "XSAVE area of %u bytes does not fit: using FXSAVE\n", ebx);
+        SetXCR0(kXCR0X87 | kXCR0SSE);
+        SetCR4(GetCR4() & ~kCR4OSXSAVE);
+        return;
+    }
+    // AP は BSP と同じ CPU であることを前提にしている
+    if(CurrentCPU() == 0) {
+        fpu_xsave_enabled = 1;
+    }
+}
+
+void InitializeFPUArea(uint8_t* area) {
+    memset(area, 0, kFPUAreaBytes); // XSAVE のヘッダも 0（すべて初期状態）
+    *reinterpret_cast<uint16_t*>(&area[0]) = 0x037f;  // FCW
+    *reinterpret_cast<uint32_t*>(&area[24]) = 0x1f80; // MXCSR
+}
+
+size_t FPUTraps() {
+    return fpu_traps.load(std::memory_order_relaxed);
+}
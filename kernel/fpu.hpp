@@ -0,0 +1,21 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// TaskContext に置く FPU の状態の領域。XSAVE で x87/SSE/AVX まで収まる
+const size_t kFPUAreaBytes = 1024;
+
+extern "C" {
+    // 1 なら SwitchContext と #NM ハンドラが XSAVEOPT/XRSTOR を使う。asmfunc.asm から読む
+    extern uint8_t fpu_xsave_enabled;
+    // #NM ハンドラから呼ばれ、現在のタスクの FPU 状態の領域を返す
+    uint8_t* CurrentFPUArea();
+}
+
+// この CPU で XSAVE を有効にする。各 CPU で最初のタスク切り替えより前に呼ぶ。
+// CR0.TS は最初の切り替えで立ち、以後 FPU の状態は使ったタスクの分だけ復元される
+void InitializeFPU();
+// 新しいタスクの FPU 状態（x87 と SSE の例外はすべてマスク）
+void InitializeFPUArea(uint8_t* area);
+// #NM で FPU の状態を復元した回数（全 CPU の合計）
+size_t FPUTraps();
@@ -1,5 +1,6 @@
 #include <string.h>
 #include "frame_buffer.hpp"
+#include "paging.hpp"
 
 namespace {
 
@@ -30,6 +31,10 @@ namespace {
     
 }
 
+FrameBuffer::~FrameBuffer() {
+    ReleaseDemandZero(reinterpret_cast<uint64_t>(buffer_), buffer_bytes_);
+}
+
 Error FrameBuffer::Initialize(const FrameBufferConfig& config) {
     config_ = config;
     const auto bytes_per_pixel = BytesPerPixel(config_.pixel_format);
@@ -37,13 +42,20 @@ Error FrameBuffer::Initialize(const FrameBufferConfig& config) {
         return MAKE_ERROR(Error::kUnknownPixelFormat);
     }
 
-    if(config_.frame_buffer) {
-        // use oridinal frame buffer, so buffer_ is not necessary.
-        buffer_.resize(0);
-    }
-    else {
-        buffer_.resize(bytes_per_pixel * config_.horizontal_resolution * config_.vertical_resolution);
-        config_.frame_buffer = buffer_.data();
+    ReleaseDemandZero(reinterpret_cast<uint64_t>(buffer_), buffer_bytes_);
+    buffer_ = nullptr;
+    buffer_bytes_ = 0;
+
+    if(config_.frame_buffer == nullptr) {
+        // 書き込まれたページだけにフレームを割り当てる
+        const size_t bytes = bytes_per_pixel * config_.horizontal_resolution * config_.vertical_resolution;
+        auto [ addr, err ] = ReserveDemandZero(bytes);
+        if(err) {
+            return err;
+        }
+        buffer_ = reinterpret_cast<uint8_t*>(addr);
+        buffer_bytes_ = bytes;
+        config_.frame_buffer = buffer_;
         config_.pixels_per_scan_line = config_.horizontal_resolution;
     }
 
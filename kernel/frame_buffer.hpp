@@ -8,6 +8,7 @@
 
 class FrameBuffer {
     public:
+        ~FrameBuffer();
         Error Initialize(const FrameBufferConfig& config);
         Error Copy(Vector2D<int> des_pos, const FrameBuffer& src, const Rectangle<int>& src_area);
         FrameBufferWriter& Writer() { return *writer_; }
@@ -15,6 +16,7 @@ class FrameBuffer {
         const FrameBufferConfig& Config() const {return config_; };
     private:
         FrameBufferConfig config_{};
-        std::vector<uint8_t> buffer_;   //  shadow frame buffer
+        uint8_t* buffer_{nullptr};   //  shadow frame buffer (demand-zero)
+        size_t buffer_bytes_{0};
         std::unique_ptr<FrameBufferWriter> writer_;
 };
@@ -0,0 +1,244 @@
+#include <algorithm>
+#include "hpet.hpp"
+#include "acpi.hpp"
+#include "logger.hpp"
+#include "paging.hpp"
+
+unsigned long hpet_freq = 0;
+
+namespace {
+    // 汎用レジスタ
+    const uint64_t kCapabilities = 0x000;
+    const uint64_t kConfiguration = 0x010;
+    const uint64_t kInterruptStatus = 0x020; // レベルトリガのタイマの割り込み中ビット。1 を書くと消える
+    const uint64_t kMainCounter = 0x0f0;
+    // タイマ n のレジスタ
+    uint64_t TimerConfig(int n) { return 0x100 + 0x20 * n; }
+    uint64_t TimerComparator(int n) { return 0x108 + 0x20 * n; }
+    uint64_t TimerFSBRoute(int n) { return 0x110 + 0x20 * n; }
+
+    const uint64_t kCapCounter64 = 1u << 13;
+    const uint64_t kConfEnable = 1u << 0;
+    const uint64_t kConfLegacyRoute = 1u << 1;
+
+    const uint64_t kTimerLevel = 1u << 1;
+    const uint64_t kTimerIntEnable = 1u << 2;
+    const uint64_t kTimerPeriodic = 1u << 3;
+    const uint64_t kTimerCap64 = 1u << 5;
+    const uint64_t kTimer32Mode = 1u << 8;
+    const int kTimerRouteShift = 9;
+    const uint64_t kTimerRouteMask = 0x1fu << kTimerRouteShift;
+    const uint64_t kTimerFSBEnable = 1u << 14;
+    const uint64_t kTimerFSBCap = 1u << 15;
+
+    const int kEventTimer = 0;
+
+    volatile uint64_t* hpet_base = nullptr;
+
+    uint64_t Read(uint64_t offset) {
+        return hpet_base[offset / 8];
+    }
+
+    void Write(uint64_t offset, uint64_t value) {
+        hpet_base[offset / 8] = value;
+    }
+
+    // MADT のエントリを順に f(先頭へのポインタ) に渡す。f が true を返したらやめる
+    template <class F>
+    void ForEachMADTEntry(F f) {
+        const auto entries_begin = reinterpret_cast<const uint8_t*>(acpi::madt + 1);
+        const auto entries_end = reinterpret_cast<const uint8_t*>(acpi::madt) + acpi::madt->header.length;
+        for(auto p = entries_begin; p + 2 <= entries_end && p[1] >= 2; p += p[1]) {
+            if(f(p)) {
+                return;
+            }
+        }
+    }
+
+    // gsi を宛先とする ISA の割り込みの上書き。なければ nullptr
+    const acpi::MADTInterruptOverride* FindOverrideTo(uint32_t gsi) {
+        const acpi::MADTInterruptOverride* found = nullptr;
+        ForEachMADTEntry([&](const uint8_t* p) {
+            const auto entry = reinterpret_cast<const acpi::MADTInterruptOverride*>(p);
+            if(p[0] == acpi::kMADTInterruptOverride && entry->gsi == gsi) {
+                found = entry;
+            }
+            return found != nullptr;
+        });
+        return found;
+    }
+
+    // ISA の割り込みがつながっている GSI か。0-15 は上書きで移されていなければ同じ番号の IRQ のもの
+    bool ClaimedByISA(uint32_t gsi) {
+        if(FindOverrideTo(gsi)) {
+            return true;
+        }
+        if(gsi >= 16) {
+            return false;
+        }
+        bool moved = false;
+        ForEachMADTEntry([&](const uint8_t* p) {
+            const auto entry = reinterpret_cast<const acpi::MADTInterruptOverride*>(p);
+            moved = p[0] == acpi::kMADTInterruptOverride && entry->bus == 0 && entry->source == gsi;
+            return moved;
+        });
+        return !moved;
+    }
+
+    // route_cap の中から、ISA の割り込みと共有しない GSI を選ぶ（16 以上を優先）。
+    // どれも共有するなら一番小さいもの
+    uint32_t ChooseGSI(uint32_t route_cap) {
+        uint32_t unclaimed = 32;
+        for(uint32_t gsi = 0; gsi < 32; ++gsi) {
+            if(((route_cap >> gsi) & 1) == 0 || ClaimedByISA(gsi)) {
+                continue;
+            }
+            if(gsi >= 16) {
+                return gsi;
+            }
+            unclaimed = std::min(unclaimed, gsi);
+        }
+        return unclaimed < 32 ? unclaimed : __builtin_ctz(route_cap);
+    }
+
+    // I/O APIC の入力 gsi を、CPU のベクタ vector（固定・物理宛先）につなぐ。
+    // 極性とトリガは MADT の上書きに従い、なければ High・エッジ
+    Error RouteIOAPIC(uint32_t gsi, uint8_t apic_id, uint8_t vector, bool& level) {
+        uint32_t redirection = vector;
+        level = false;
+        if(auto entry = FindOverrideTo(gsi)) {
+            if((entry->flags & 0b11) == 0b11) {
+                redirection |= 1u << 13; // Low
+            }
+            if(((entry->flags >> 2) & 0b11) == 0b11) {
+                redirection |= 1u << 15; // レベル
+                level = true;
+            }
+        }
+
+        Error result = MAKE_ERROR(Error::kIndexOutOfRange);
+        ForEachMADTEntry([&](const uint8_t* p) {
+            if(p[0] != acpi::kMADTIOAPIC) {
+                return false;
+            }
+            const auto& entry = *reinterpret_cast<const acpi::MADTIOAPIC*>(p);
+            if(auto err = MapIdentity(entry.address, 0x20, kPageWritable | kPageCacheDisable)) {
+                result = err;
+                return true;
+            }
+            volatile uint32_t* regsel = reinterpret_cast<uint32_t*>(entry.address);
+            volatile uint32_t* window = reinterpret_cast<uint32_t*>(entry.address + 0x10);
+            *regsel = 1; // IOAPICVER。ビット 16-23 は最後の入力の番号
+            const uint32_t num_inputs = ((*window >> 16) & 0xff) + 1;
+            if(gsi < entry.gsi_base || gsi >= entry.gsi_base + num_inputs) {
+                return false;
+            }
+            const uint32_t index = 0x10 + 2 * (gsi - entry.gsi_base);
+            *regsel = index + 1;
+            *window = static_cast<uint32_t>(apic_id) << 24;
+            *regsel = index;
+            *window = redirection; // マスクなし
+            result = MAKE_ERROR(Error::kSuccess);
+            return true;
+        });
+        return result;
+    }
+}
+
+Error InitializeHPET() {
+    if(acpi::hpet == nullptr || acpi::hpet->address_space_id != 0) {
+        return MAKE_ERROR(Error::kNotImplemented);
+    }
+    const uint64_t address = acpi::hpet->address;
+    if(auto err = MapIdentity(address, 0x400, kPageWritable | kPageCacheDisable)) {
+        return err;
+    }
+    hpet_base = reinterpret_cast<volatile uint64_t*>(address);
+
+    const uint64_t caps = Read(kCapabilities);
+    const uint64_t period_fs = caps >> 32; // 主カウンタの周期（フェムト秒）
+    if(period_fs == 0 || period_fs > 100000000 || (caps & kCapCounter64) == 0) {
+        hpet_base = nullptr;
+        return MAKE_ERROR(Error::kNotImplemented);
+    }
+    hpet_freq = 1000000000000000ul / period_fs;
+
+    // レガシー置き換えは使わない（タイマ 0, 1 を PIT と RTC の代わりにつながない）
+    Write(kConfiguration, (Read(kConfiguration) & ~kConfLegacyRoute) | kConfEnable);
+    Log(kInfo, "HPET: %lu kHz, %lu timers\n", hpet_freq / 1000, ((caps >> 8) & 0x1f) + 1);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+bool HPETAvailable() {
+    return hpet_base != nullptr;
+}
+
+uint64_t ReadHPETCounter() {
+    return Read(kMainCounter);
+}
+
+Error StartHPETEvents(uint8_t apic_id, uint8_t vector) {
+    if(!HPETAvailable()) {
+        return MAKE_ERROR(Error::kNotImplemented);
+    }
+    uint64_t config = Read(TimerConfig(kEventTimer));
+    if((config & kTimerCap64) == 0) {
+        return MAKE_ERROR(Error::kNotImplemented);
+    }
+    config &= ~(kTimerLevel | kTimerIntEnable | kTimerPeriodic | kTimer32Mode | kTimerRouteMask | kTimerFSBEnable);
+    Write(TimerConfig(kEventTimer), config);
+    StopHPETEvent();
+
+    if(config & kTimerFSBCap) {
+        // MSI と同じ形式：上位 32 ビットがアドレス、下位 32 ビットがデータ
+        const uint64_t msi_address = 0xfee00000u | (static_cast<uint32_t>(apic_id) << 12);
+        Write(TimerFSBRoute(kEventTimer), (msi_address << 32) | vector);
+        config |= kTimerFSBEnable;
+    }
+    else {
+        // 割り当てられる I/O APIC の入力はビットマップで示される
+        const uint32_t route_cap = config >> 32;
+        if(route_cap == 0) {
+            return MAKE_ERROR(Error::kNotImplemented);
+        }
+        if(acpi::madt == nullptr) {
+            return MAKE_ERROR(Error::kNotImplemented);
+        }
+        const uint32_t gsi = ChooseGSI(route_cap);
+        bool level;
+        if(auto err = RouteIOAPIC(gsi, apic_id, vector, level)) {
+            return err;
+        }
+        config |= static_cast<uint64_t>(gsi) << kTimerRouteShift;
+        if(level) {
+            config |= kTimerLevel;
+        }
+    }
+    Write(TimerConfig(kEventTimer), config | kTimerIntEnable); // 単発
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void SetHPETEvent(uint64_t counter) {
+    // 比較器は一致したときにしか割り込まないので、書いている間に過ぎたら設定し直す
+    const uint64_t min_delta = std::max<uint64_t>(hpet_freq / 100000, 1); // 10 マイクロ秒
+    uint64_t now = ReadHPETCounter();
+    while(true) {
+        if(static_cast<int64_t>(counter - now) < static_cast<int64_t>(min_delta)) {
+            counter = now + min_delta;
+        }
+        Write(TimerComparator(kEventTimer), counter);
+        now = ReadHPETCounter();
+        if(static_cast<int64_t>(counter - now) > 0) {
+            return;
+        }
+    }
+}
+
+void AckHPETEvent() {
+    Write(kInterruptStatus, static_cast<uint64_t>(1) << kEventTimer);
+}
+
+void StopHPETEvent() {
+    // 64 ビットのカウンタが一周するまで一致しない
+    Write(TimerComparator(kEventTimer), ReadHPETCounter() - 1);
+}
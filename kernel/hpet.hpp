@@ -0,0 +1,22 @@
+#pragma once
+#include <cstdint>
+#include "error.hpp"
+
+// High Precision Event Timer。ACPI の HPET 表から見つけ、
+// 主カウンタを TSC・Local APIC タイマの較正に、タイマ 0 を BSP の単発のイベントタイマに使う
+
+extern unsigned long hpet_freq; // 主カウンタの 1 秒間あたりのカウント数。HPET がなければ 0
+
+// acpi::Initialize の後、InitializeClock の前に呼ぶ。HPET がなければ kNotImplemented
+Error InitializeHPET();
+bool HPETAvailable();
+uint64_t ReadHPETCounter();
+
+// タイマ 0 の割り込みを、CPU（APIC ID）のベクタ vector に届くよう設定する。
+// FSB（MSI）で送れなければ、ISA の割り込みと共有しない入力を選んで I/O APIC を通す
+Error StartHPETEvents(uint8_t apic_id, uint8_t vector);
+// 割り込みハンドラで EOI の前に呼ぶ（レベルトリガのときに割り込み中の状態を消す）
+void AckHPETEvent();
+// 主カウンタが counter になったら割り込む。過ぎていれば、すぐに割り込むよう少し先に設定する
+void SetHPETEvent(uint64_t counter);
+void StopHPETEvent();
@@ -2,6 +2,8 @@
 #include "timer.hpp"
 #include "asmfunc.h"
 #include "task.hpp"
+#include "paging.hpp"
+#include "logger.hpp"
 
 std::array<InterruptDescriptor, 256> idt;
 
@@ -32,6 +34,45 @@ namespace {
     void IntHandlerAPICTimer(InterruptFrame* frame) {
       LAPICTimerOnInterrupt();
     }
+
+    // 他の CPU から、実行待ちのタスクを置いた・盗みに来いと知らされた
+    __attribute__((interrupt))
+    void IntHandlerReschedule(InterruptFrame* frame) {
+      NotifyEndOfInterrupt();
+      task_manager->SwitchTask();
+    }
+
+    __attribute__((interrupt))
+    void IntHandlerHPETTimer(InterruptFrame* frame) {
+      HPETTimerOnInterrupt();
+    }
+
+    // 他の CPU がページの対応付けを外した・変えた
+    __attribute__((interrupt))
+    void IntHandlerTLBShootdown(InterruptFrame* frame) {
+      HandleTLBShootdown();
+      NotifyEndOfInterrupt();
+    }
+
+    // spurious interrupt には EOI を送らない
+    __attribute__((interrupt))
+    void IntHandlerSpurious(InterruptFrame* frame) {
+    }
+
+    void HaltOnPageFault(uint64_t causal_addr, uint64_t error_code, uint64_t rip,
+                         const Error& err) {
+      Log(kError, "#PF at %016lx (error %02lx), rip %016lx: %s\n",
+          causal_addr, error_code, rip, err.Name());
+      while (true) __asm__("hlt");
+    }
+
+    __attribute__((interrupt))
+    void IntHandlerPageFault(InterruptFrame* frame, uint64_t error_code) {
+      const uint64_t causal_addr = GetCR2();
+      if (auto err = HandlePageFault(error_code, causal_addr)) {
+        HaltOnPageFault(causal_addr, error_code, frame->rip, err);
+      }
+    }
 }
 
 // 割り込み記述子テーブルの設定
@@ -44,5 +85,26 @@ void InitializeInterrupt() {
     SetIDTEntry(idt[InterruptVector::kLAPICTimer], MakeIDTAttr(DescriptorType::kInterruptGate,0),
                 reinterpret_cast<uint64_t>(IntHandlerAPICTimer), kKernelCS);
 
+    // 遅延 FPU 切り替え用（asmfunc.asm）
+    SetIDTEntry(idt[InterruptVector::kDeviceNotAvailable], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+                reinterpret_cast<uint64_t>(IntHandlerDeviceNotAvailable), kKernelCS);
+
+    // 要求時ゼロ・コピーオンライト用のページフォールトハンドラ
+    SetIDTEntry(idt[InterruptVector::kPageFault],
+                MakeIDTAttr(DescriptorType::kInterruptGate, 0, true, kISTForPageFault),
+                reinterpret_cast<uint64_t>(IntHandlerPageFault), kKernelCS);
+
+    SetIDTEntry(idt[InterruptVector::kReschedule], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+                reinterpret_cast<uint64_t>(IntHandlerReschedule), kKernelCS);
+
+    SetIDTEntry(idt[InterruptVector::kHPETTimer], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+                reinterpret_cast<uint64_t>(IntHandlerHPETTimer), kKernelCS);
+
+    SetIDTEntry(idt[InterruptVector::kTLBShootdown], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+                reinterpret_cast<uint64_t>(IntHandlerTLBShootdown), kKernelCS);
+
+    SetIDTEntry(idt[InterruptVector::kSpurious], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+                reinterpret_cast<uint64_t>(IntHandlerSpurious), kKernelCS);
+
     LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
 }
@@ -39,8 +39,14 @@ void SetIDTEntry(InterruptDescriptor& desc, InterruptDescriptorAttribute attr,
 class InterruptVector {
     public:
         enum Number {
+            kDeviceNotAvailable = 0x07,
+            kPageFault = 0x0e,
             kXHCI = 0x40,
-            kLAPICTimer = 0x41 //  01000001
+            kLAPICTimer = 0x41, //  01000001
+            kReschedule = 0x42, // CPU 間割り込み。タスクを切り替えさせる
+            kHPETTimer = 0x43,
+            kTLBShootdown = 0x44, // CPU 間割り込み。TLB のエントリを消させる
+            kSpurious = 0xff    // Local APIC の spurious interrupt
         };
 };
 
@@ -65,4 +71,20 @@ struct InterruptFrame {
     uint64_t ss;
 };
 
+// Disable interrupts for the lifetime of the object and restore IF afterwards,
+// so it can be used whether or not interrupts are already disabled.
+class InterruptGuard {
+    public:
+        InterruptGuard() {
+            __asm__ volatile("pushfq\n\tpop %0\n\tcli" : "=r"(rflags_) :: "memory");
+        }
+        ~InterruptGuard() {
+            if(rflags_ & 0x200) {
+                __asm__ volatile("sti" ::: "memory");
+            }
+        }
+    private:
+        uint64_t rflags_;
+};
+
 void InitializeInterrupt();
\ No newline at end of file
@@ -81,7 +81,7 @@ void LayerManager::Draw(const Rectangle<int>& area) const {
     for (auto layer : layer_stack_) {
         layer->DrawTo(back_buffer_, area);
     }
-    screen_->Copy(area.pos, back_buffer_, area);
+    CopyToScreen(area);
 }
 
 void LayerManager::Draw(unsigned int id) const {
@@ -105,7 +105,11 @@ void LayerManager::Draw(unsigned int id, Rectangle<int> area) const {
             layer->DrawTo(back_buffer_, window_area);
         }
     }
-    screen_->Copy(window_area.pos, back_buffer_, window_area);
+    CopyToScreen(window_area);
+}
+
+void LayerManager::CopyToScreen(const Rectangle<int>& area) const {
+    screen_->Copy(area.pos, back_buffer_, area);
 }
 
 void LayerManager::Hide(unsigned int id) {
@@ -220,6 +224,7 @@ namespace {
 LayerManager* layer_manager;
 ActiveLayer* active_layer;
 std::map<unsigned int, uint64_t>* layer_task_map;
+Mutex layer_mutex;
 
 void InitializeLayer() {
     const auto screen_size = ScreenSize();
@@ -260,7 +265,41 @@ void InitializeLayer() {
     active_layer = new ActiveLayer{ *layer_manager };
 }
 
-void ProcessLayerMessage(const Message& msg) {
+void LayerDrawBatch::Add(unsigned int layer_id) {
+    Add(layer_id, { {0, 0}, {-1, -1} });
+}
+
+void LayerDrawBatch::Add(unsigned int layer_id, const Rectangle<int>& area) {
+    for (size_t i = 0; i < num_entries_; ++i) {
+        auto& entry = entries_[i];
+        if (entry.layer_id != layer_id) {
+            continue;
+        }
+        if (entry.area.size.x < 0 || area.size.x < 0) {
+            entry.area = { {0, 0}, {-1, -1} };
+        }
+        else { // 両方を含む矩形にまとめる
+            const auto end = ElementMax(entry.area.pos + entry.area.size, area.pos + area.size);
+            entry.area.pos = ElementMin(entry.area.pos, area.pos);
+            entry.area.size = end - entry.area.pos;
+        }
+        return;
+    }
+
+    if (num_entries_ == kMaxEntries) {
+        Flush();
+    }
+    entries_[num_entries_++] = { layer_id, area };
+}
+
+void LayerDrawBatch::Flush() {
+    for (size_t i = 0; i < num_entries_; ++i) {
+        layer_manager->Draw(entries_[i].layer_id, entries_[i].area);
+    }
+    num_entries_ = 0;
+}
+
+void ProcessLayerMessage(const Message& msg, LayerDrawBatch& batch) {
     const auto& arg = msg.arg.layer;
     switch (arg.op) {
     case LayerOperation::Move:
@@ -270,10 +309,10 @@ void ProcessLayerMessage(const Message& msg) {
         layer_manager->MoveRelative(arg.layer_id, { arg.x, arg.y });
         break;
     case LayerOperation::Draw:
-        layer_manager->Draw(arg.layer_id);
+        batch.Add(arg.layer_id);
         break;
     case LayerOperation::DrawArea:
-        layer_manager->Draw(arg.layer_id, { {arg.x, arg.y}, {arg.w, arg.h} });
+        batch.Add(arg.layer_id, { {arg.x, arg.y}, {arg.w, arg.h} });
         break;
     }
 }
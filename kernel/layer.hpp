@@ -1,10 +1,12 @@
 #pragma once
+#include <array>
 #include <memory>
 #include <map>
 #include <vector>
 #include "window.hpp"
 #include "graphics.hpp"
 #include "message.hpp"
+#include "mutex.hpp"
 
 class Layer {
 public:
@@ -33,6 +35,8 @@ public:
     void Draw(const Rectangle<int>& area) const;
     void Draw(unsigned int id) const;
     void Draw(unsigned int id, Rectangle<int> area) const;
+    // back bufferの内容をそのままframe bufferに転送する
+    void CopyToScreen(const Rectangle<int>& area) const;
     void Move(unsigned int id, Vector2D<int> new_position);
     void MoveRelative(unsigned int id, Vector2D<int> pos_diff);
     Layer* FindLayerByPosition(Vector2D<int> pos, unsigned int exclude_id) const;
@@ -61,12 +65,30 @@ private:
     unsigned int mouse_layer_{ 0 };
 };
 
+// メッセージをまとめて処理する間に溜めておき、最後にレイヤごとに 1 回だけ描画する
+class LayerDrawBatch {
+public:
+    void Add(unsigned int layer_id);
+    void Add(unsigned int layer_id, const Rectangle<int>& area); // area はレイヤ内の座標
+    void Flush();
+private:
+    static const size_t kMaxEntries = 16; // 溢れたらその場で描画する
+    struct Entry {
+        unsigned int layer_id;
+        Rectangle<int> area; // size が負ならレイヤ全体
+    };
+    std::array<Entry, kMaxEntries> entries_;
+    size_t num_entries_{ 0 };
+};
+
 extern LayerManager* layer_manager;
 extern ActiveLayer* active_layer;
 extern std::map<unsigned int, uint64_t>* layer_task_map;
+// 上の 3 つを使うタスクが取る
+extern Mutex layer_mutex;
 
 void InitializeLayer();
-void ProcessLayerMessage(const Message& msg);
+void ProcessLayerMessage(const Message& msg, LayerDrawBatch& batch);
 
 constexpr Message MakeLayerMessage(uint64_t task_id, unsigned int layer_id, LayerOperation op, const Rectangle<int>& area) {
     Message msg{ Message::kLayer, task_id };
@@ -1,7 +1,9 @@
 #include <cstdio>
+#include <array>
 #include <cstdint>
 #include <cstddef>
 #include <cstring>
+#include <algorithm>
 #include <numeric>
 #include <vector>
 
@@ -18,13 +20,17 @@
 #include "memory_map.hpp"
 #include "segment.hpp"
 #include "paging.hpp"
+#include "smp.hpp"
 #include "memory_manager.hpp"
 #include "layer.hpp"
 #include "timer.hpp"
 #include "message.hpp"
 #include "acpi.hpp"
+#include "clock.hpp"
+#include "hpet.hpp"
 #include "keyboard.hpp"
 #include "task.hpp"
+#include "fpu.hpp"
 #include "terminal.hpp"
 #include "fat.hpp"
 #include "usb/memory.hpp"
@@ -35,6 +41,9 @@
 
 alignas(16) uint8_t kernel_main_stack[1024 * 1024];
 
+// ブートローダのスタック（ブートサービスの領域）にあるメモリマップを、解放前に複製しておく
+alignas(16) uint8_t memory_map_buf[4096 * 4];
+
 int printk(const char* format, ...) {
     va_list ap;
     int result;
@@ -110,25 +119,39 @@ void InputTextWindow(char c) {
         ++text_window_index;
         DrawTextCursor(true);
     }
-
-    layer_manager->Draw(text_window_layer_id);
 }
 
 extern "C" void KernelMainNewStack(const struct FrameBufferConfig& frame_buffer_config_ref,
     const MemoryMap& memory_map_ref,
     const acpi::RSDP& acpi_table, void* volume_image) {
+    MemoryMap memory_map{ memory_map_ref };
+    // 入りきらなければ、途中で切れた記述子を読まないように記述子の境界で切る
+    const auto full_map_size = memory_map.map_size;
+    if (memory_map.map_size > sizeof(memory_map_buf)) {
+        memory_map.map_size = sizeof(memory_map_buf) / memory_map.descriptor_size
+            * memory_map.descriptor_size;
+    }
+    memcpy(memory_map_buf, memory_map_ref.buffer, memory_map.map_size);
+    memory_map.buffer = memory_map_buf;
+    memory_map.buffer_size = sizeof(memory_map_buf);
+
     // Display background and Console
     InitializeGraphics(frame_buffer_config_ref);
     InitializeConsole();
+    if (memory_map.map_size < full_map_size) {
+        Log(kError, "memory map truncated: %llu of %llu bytes (%llu-byte descriptors)\n",
+            memory_map.map_size, full_map_size, memory_map.descriptor_size);
+    }
 
     printk("Welcom to MikanOS!\n");
     SetLogLevel(kWarn);
 
     InitializeSegmentation();
 
-    InitializePaging();
+    InitializeMemoryManager(memory_map);
 
-    InitializeMemoryManager(memory_map_ref);
+    InitializePaging(memory_map);
+    const size_t boot_services_frames = ReleaseBootServicesMemory(memory_map);
 
     // Make Interrupt Descriptor Table(IDT) and MSI interrupt Settings.
     InitializeInterrupt();
@@ -148,19 +171,43 @@ extern "C" void KernelMainNewStack(const struct FrameBufferConfig& frame_buffer_
 
     // initialize local APIC timer, Set a timer for cursor
     acpi::Initialize(acpi_table);
+    if(auto err = InitializeHPET()) {
+        Log(kInfo, "HPET is not used: %s\n", err.Name());
+    }
+    InitializeClock(); // TSC の周波数を測る（HPET があればそれで、なければ PM タイマで）
+
+    // 起動時にしか使わない領域を解放する
+    const size_t acpi_frames = ReclaimACPIMemory(memory_map);
+    const size_t volume_frames = fat::ReleaseUnusedRegions();
+    printk("reclaimed %lu frames (boot services %lu, ACPI %lu, volume image %lu)\n",
+        boot_services_frames + acpi_frames + volume_frames,
+        boot_services_frames, acpi_frames, volume_frames);
     InitializeLAPICTimer();
-    const int kTextboxCursorTimer = 1;
-    const int kTimer05sec = 50; // 0.5s = 10ms * 50
-    __asm__("cli");
-    timer_manager->AddTimer(Timer{ kTimer05sec, kTextboxCursorTimer });
-    __asm__("sti");
-    bool textbox_cursor_visible = false;
 
     // Initialize task manager
+    InitializeFPU(); // 最初のタスク切り替えより前に
     InitializeTask(); // 現在のコンテキストを生成
     Task& main_task = task_manager->CurrentTask();
 
-    const uint64_t task_terminal_id = task_manager->NewTask().InitContext(TaskTerminal, 0).Wakeup().ID();
+    // タイマの期限は、持ち主の main_task に直接届く
+    const int kTextboxCursorTimer = 1;
+    const int kTimer05sec = kTimerFreq / 2; // 0.5s
+    timer_manager->AddTimer(Timer{ kTimer05sec, kTextboxCursorTimer, main_task.ID() });
+    bool textbox_cursor_visible = false;
+    // ProcessEvents はイベントリングを空にするまで処理するので、割り込みの通知は 1 つで足りる
+    main_task.CoalesceMessages(Message::kInterruptXHCI);
+
+    // AP を起動する（各 AP は idle タスクとして待機し、他の CPU からタスクを盗む）
+    InitializeSMP(memory_map);
+    printk("%d CPUs online\n", num_cpus);
+
+    // 専用のアドレス空間を持つタスクは、他の CPU の TLB を消せないので移さない
+    Task& terminal_task = task_manager->NewTask().InitContext(TaskTerminal, 0).Pin();
+    if (auto err = terminal_task.CreateAddressSpace()) {
+        Log(kError, "failed to create address space: %s at %s:%d\n",
+            err.Name(), err.File(), err.Line());
+    }
+    terminal_task.Wakeup();
 
     // MSI interrupt settings, USB driver initialization, xhc restart
     usb::xhci::Initialize();
@@ -169,72 +216,67 @@ extern "C" void KernelMainNewStack(const struct FrameBufferConfig& frame_buffer_
     InitializeKeyboard();
 
     char str[128];
+    std::array<Message, 32> msgs;
+    LayerDrawBatch draw_batch;
     while (true) {
-        __asm__("cli"); // Disable the interrupt flag for data race
-        const auto tick = timer_manager->CurrentTick();
-        __asm__("sti");  // Enable the interrupt
+        // 1 つ目が届くまで眠り、残りは届いている分をまとめて取り出す
+        msgs[0] = *main_task.WaitMessage();
+        const size_t num_msgs = 1 + main_task.ReceiveMessages(&msgs[1], msgs.size() - 1);
+
+        // 描画はまとめて最後に 1 回だけ行う
+        layer_mutex.Lock();
+        for (size_t i = 0; i < num_msgs; ++i) {
+            const Message& msg = msgs[i];
+            switch (msg.type) {
+            case Message::kInterruptXHCI:
+                usb::xhci::ProcessEvents();
+                break;
+            case Message::kTimerTimeout:
+                if (msg.arg.timer.value == kTextboxCursorTimer) { // カーソル用のタイマ
+                    timer_manager->AddTimer(Timer{ msg.arg.timer.timeout + kTimer05sec, kTextboxCursorTimer, main_task.ID() });
+                    textbox_cursor_visible = !textbox_cursor_visible;
+                    DrawTextCursor(textbox_cursor_visible);
+                    draw_batch.Add(text_window_layer_id);
+                }
+                break;
+            case Message::kKeyPush:
+                if (auto act = active_layer->GetActive(); act == text_window_layer_id) {
+                    InputTextWindow(msg.arg.keyboard.ascii);
+                    draw_batch.Add(text_window_layer_id);
+                }
+                else {
+                    auto task_it = layer_task_map->find(act);
+                    if (task_it != layer_task_map->end()) {
+                        task_manager->SendMessage(task_it->second, msg);
+                    }
+                    else {
+                        printk("key push not handled: keycode %02x, ascii %02x\n",
+                            msg.arg.keyboard.keycode,
+                            msg.arg.keyboard.ascii);
+                    }
+                }
+                break;
+            case Message::kLayer:
+                ProcessLayerMessage(msg, draw_batch);
+                break;
+            default:
+                Log(kError, "Unknown message type: %d\n", msg.type);
+            }
+        }
 
+        const auto tick = timer_manager->CurrentTick();
         sprintf(str, "%010lu", tick);
         FillRectangle(*main_window->InnerWriter(), { 20, 4 }, { 8 * 10, 16 }, { 0xc6, 0xc6, 0xc6 });
         WriteString(*main_window->InnerWriter(), { 20, 4 }, str, { 0,0,0 });
-        layer_manager->Draw(main_window_layer_id);
-
-        __asm__("cli");
-        auto msg = main_task.ReceiveMessage();
-        if (!msg) {
-            main_task.Sleep();
-            __asm__("sti");
-            continue;
-        }
-
-        __asm__("sti");   // Enable the interrupt flag
-
-        switch (msg->type) {
-        case Message::kInterruptXHCI:
-            usb::xhci::ProcessEvents();
-            break;
-        case Message::kTimerTimeout:
-            if (msg->arg.timer.value == kTextboxCursorTimer) { // カーソル用のタイマ
-                __asm__("cli");
-                timer_manager->AddTimer(Timer{ msg->arg.timer.timeout + kTimer05sec, kTextboxCursorTimer });
-                __asm__("sti");
-                textbox_cursor_visible = !textbox_cursor_visible;
-                DrawTextCursor(textbox_cursor_visible);
-                layer_manager->Draw(text_window_layer_id);
-
-                __asm__("cli");
-                task_manager->SendMessage(task_terminal_id, *msg);
-                __asm__("sti");
-            }
-            break;
-        case Message::kKeyPush:
-            if (auto act = active_layer->GetActive(); act == text_window_layer_id) {
-                InputTextWindow(msg->arg.keyboard.ascii);
-            }
-            else {
-                __asm__("cli");
-                auto task_it = layer_task_map->find(act);
-                __asm__("sti");
-                if (task_it != layer_task_map->end()) {
-                    __asm__("cli");
-                    task_manager->SendMessage(task_it->second, *msg);
-                    __asm__("sti");
-                }
-                else {
-                    printk("key push not handled: keycode %02x, ascii %02x\n",
-                        msg->arg.keyboard.keycode,
-                        msg->arg.keyboard.ascii);
-                }
+        draw_batch.Add(main_window_layer_id);
+        draw_batch.Flush();
+        layer_mutex.Unlock();
+
+        // 描画が済んでから完了を知らせる
+        for (size_t i = 0; i < num_msgs; ++i) {
+            if (msgs[i].type == Message::kLayer) {
+                task_manager->SendMessage(msgs[i].src_task, Message{ Message::kLayerFinish });
             }
-            break;
-        case Message::kLayer:
-            ProcessLayerMessage(*msg);
-            __asm__("cli");
-            task_manager->SendMessage(msg->src_task, Message{ Message::kLayerFinish });
-            __asm__("sti");
-            break;
-        default:
-            Log(kError, "Unknown message type: %d\n", msg->type);
         }
     }
 }
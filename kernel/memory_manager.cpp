@@ -1,37 +1,48 @@
+#include <algorithm>
 #include "memory_manager.hpp"
+#include "buddy_memory_manager.hpp"
 extern "C" caddr_t program_break, program_break_end;
+extern "C" size_t heap_bytes_in_use, heap_high_water_mark;
 
 namespace {
 
-char memory_manager_buf[sizeof(BitmapMemoryManager)];
-BitmapMemoryManager* memory_manager;
+alignas(16) char memory_manager_buf[
+    std::max(sizeof(BitmapMemoryManager), sizeof(BuddyMemoryManager))];
 
-Error InitializeHeap(BitmapMemoryManager& memory_manager) {
-    const int kHeapFrames = 64 * 512;
-    const auto heap_start = memory_manager.Allocate(kHeapFrames);
-    if(heap_start.error) {
-        return heap_start.error;
-    }
+const size_t kHeapChunkFrames = 512;
+size_t heap_frames = 0; // ヒープ用に確保したフレーム数
+size_t reclaimed_frames = 0; // 起動後に解放したフレーム数
 
-    program_break = reinterpret_cast<caddr_t>(heap_start.value.ID() * kBytesPerFrame);
-    program_break_end = program_break + kHeapFrames * kBytesPerFrame;
-    return MAKE_ERROR(Error::kSuccess);
+template <class Pred>
+size_t ReclaimMemoryOfType(const MemoryMap& memory_map, Pred pred) {
+    size_t frames = 0;
+    const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
+    for(uintptr_t iter = memory_map_base; iter < memory_map_base + memory_map.map_size;
+        iter += memory_map.descriptor_size) {
+        auto desc = reinterpret_cast<const MemoryDescriptor*>(iter);
+        if(pred(static_cast<MemoryType>(desc->type))) {
+            frames += ReclaimMemory(desc->physical_start,
+                                    desc->physical_start + desc->number_of_pages * kUEFIPageSize);
+        }
+    }
+    return frames;
 }
 
 }
 
-BitmapMemoryManager::BitmapMemoryManager() : alloc_map_{}, range_begin_{0}, range_end_{FrameID{kFrameCount}} {
+BitmapMemoryManager::BitmapMemoryManager() 
+    : alloc_map_{}, full_map_{}, range_begin_{0}, range_end_{FrameID{kFrameCount}}, hint_{0} {
 };
 
 void BitmapMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames) {
-    for(size_t i = 0; i < num_frames; i++) {
-        SetBit(FrameID{start_frame.ID() + i}, true);
-    }
+    SpinLockGuard guard{lock_};
+    SetBits(start_frame, num_frames, true);
 }
 
 void BitmapMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end) {
     range_begin_ = range_begin;
     range_end_ = range_end;
+    hint_ = range_begin;
 }
 
 bool BitmapMemoryManager::GetBit(FrameID frame) const {
@@ -40,52 +51,154 @@ bool BitmapMemoryManager::GetBit(FrameID frame) const {
     return (alloc_map_[line_index] & static_cast<MapLineType>(1) << bit_index) != 0;
 }
 
-void BitmapMemoryManager::SetBit(FrameID frame, bool allocated) {
-    auto line_index = frame.ID() / kBitsPerMapLine;
-    auto bit_index =  frame.ID() % kBitsPerMapLine;
+// 1ビットずつではなく、map line単位でまとめて書き換える
+void BitmapMemoryManager::SetBits(FrameID start_frame, size_t num_frames, bool allocated) {
+    size_t frame = start_frame.ID();
+    const size_t end = frame + num_frames;
+    while(frame < end) {
+        const auto line_index = frame / kBitsPerMapLine;
+        const auto bit_index = frame % kBitsPerMapLine;
+        const size_t bits = std::min(kBitsPerMapLine - bit_index, end - frame);
+        const MapLineType mask = bits == kBitsPerMapLine
+            ? ~static_cast<MapLineType>(0)
+            : ((static_cast<MapLineType>(1) << bits) - 1) << bit_index;
 
-    if(allocated) {
-        alloc_map_[line_index] |= (static_cast<MapLineType>(1) << bit_index);
+        if(allocated) {
+            alloc_map_[line_index] |= mask;
+        }
+        else {
+            alloc_map_[line_index] &= ~mask;
+        }
+        UpdateFullMap(line_index);
+        frame += bits;
+    }
+}
+
+void BitmapMemoryManager::UpdateFullMap(size_t line_index) {
+    const auto summary_bit = static_cast<MapLineType>(1) << (line_index % kBitsPerMapLine);
+    if(alloc_map_[line_index] == ~static_cast<MapLineType>(0)) {
+        full_map_[line_index / kBitsPerMapLine] |= summary_bit;
     }
     else {
-        alloc_map_[line_index] &= ~(static_cast<MapLineType>(1) << bit_index);
+        full_map_[line_index / kBitsPerMapLine] &= ~summary_bit;
+    }
+}
+
+// [begin, end) の中で最初の未使用フレームを返す. 見つからなければ end を返す.
+size_t BitmapMemoryManager::FindFreeFrame(size_t begin, size_t end) const {
+    size_t frame = begin;
+    while(frame < end) {
+        const auto line_index = frame / kBitsPerMapLine;
+        const auto bit_index = frame % kBitsPerMapLine;
+
+        if(bit_index == 0) {
+            // skip the run of fully allocated lines in one step
+            const auto summary = full_map_[line_index / kBitsPerMapLine] >> (line_index % kBitsPerMapLine);
+            const size_t full_lines = ~summary == 0 ? kBitsPerMapLine : __builtin_ctzl(~summary);
+            if(full_lines > 0) {
+                frame += full_lines * kBitsPerMapLine;
+                continue;
+            }
+        }
+
+        const MapLineType free_bits = ~alloc_map_[line_index] & (~static_cast<MapLineType>(0) << bit_index);
+        if(free_bits == 0) {
+            frame = (line_index + 1) * kBitsPerMapLine;
+            continue;
+        }
+        return std::min(line_index * kBitsPerMapLine + __builtin_ctzl(free_bits), end);
+    }
+    return end;
+}
+
+// [begin, end) の中で最初の使用中フレームを返す. 見つからなければ end を返す.
+size_t BitmapMemoryManager::FindAllocatedFrame(size_t begin, size_t end) const {
+    size_t frame = begin;
+    while(frame < end) {
+        const auto line_index = frame / kBitsPerMapLine;
+        const auto bit_index = frame % kBitsPerMapLine;
+        const MapLineType used_bits = alloc_map_[line_index] & (~static_cast<MapLineType>(0) << bit_index);
+        if(used_bits == 0) {
+            frame = (line_index + 1) * kBitsPerMapLine;
+            continue;
+        }
+        return std::min(line_index * kBitsPerMapLine + __builtin_ctzl(used_bits), end);
+    }
+    return end;
+}
+
+WithError<FrameID> BitmapMemoryManager::AllocateIn(size_t begin, size_t end, size_t num_frames) {
+    size_t start_frame_id = begin;
+    while(true) {
+        start_frame_id = FindFreeFrame(start_frame_id, end);
+        if(start_frame_id + num_frames > end) {
+            return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+        }
+
+        const auto run_end = FindAllocatedFrame(start_frame_id, start_frame_id + num_frames);
+        if(run_end == start_frame_id + num_frames) { // 連続した未使用領域を発見
+            SetBits(FrameID{start_frame_id}, num_frames, true);
+            hint_ = FrameID{run_end < range_end_.ID() ? run_end : range_begin_.ID()};
+            return {
+                FrameID{start_frame_id},
+                MAKE_ERROR(Error::kSuccess)
+            };
+        }
+        start_frame_id = run_end;
     }
 }
 
 // 指定したフレーム数のメモリ領域を確保
+// 前回確保した位置(hint_)から探し、見つからなければ先頭から探し直す
 WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames) {
+    SpinLockGuard guard{lock_};
+    const size_t hint = hint_.ID();
+    if(auto result = AllocateIn(hint, range_end_.ID(), num_frames); !result.error) {
+        return result;
+    }
+    if(hint == range_begin_.ID()) {
+        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+    // the run may start before the hint and cross it
+    const size_t end = std::min(hint + num_frames - 1, range_end_.ID());
+    return AllocateIn(range_begin_.ID(), end, num_frames);
+}
+
+WithError<FrameID> BitmapMemoryManager::AllocateFirstFit(size_t num_frames) {
+    SpinLockGuard guard{lock_};
     size_t start_frame_id = range_begin_.ID();
     while(true) {
         size_t i = 0;
         for(; i < num_frames; i++) {
-            if(start_frame_id  + i >= range_end_.ID()) {
+            if(start_frame_id + i >= range_end_.ID()) {
                 return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
             }
             if(GetBit(FrameID{start_frame_id + i})) {
                 break;
             }
         }
-        if(i == num_frames) { // 連続した未使用領域を発見
-            MarkAllocated(FrameID{start_frame_id}, num_frames);
-            return {
-                FrameID{start_frame_id},
-                MAKE_ERROR(Error::kSuccess)
-            };
+        if(i == num_frames) {
+            SetBits(FrameID{start_frame_id}, num_frames, true);
+            return {FrameID{start_frame_id}, MAKE_ERROR(Error::kSuccess)};
         }
         start_frame_id += i + 1;
     }
 }
 
 Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames) {
-    for(size_t i = 0; i < num_frames; i++) {
-        SetBit(FrameID{start_frame.ID() + i}, false);
-    }
+    SpinLockGuard guard{lock_};
+    SetBits(start_frame, num_frames, false);
     return MAKE_ERROR(Error::kSuccess);
 }
 
-// BIOSからのmemory mapを用いて、OSのmemory managerを初期化
-void InitializeMemoryManager(const MemoryMap& memory_map) {
-    ::memory_manager = new(memory_manager_buf) BitmapMemoryManager;
+MemoryManager* memory_manager;
+MemoryManagerType memory_manager_type;
+
+namespace {
+
+// BIOSからのmemory mapを用いて、ビットマップ方式のmemory managerを初期化
+MemoryManager* InitializeBitmapMemoryManager(const MemoryMap& memory_map) {
+    auto bitmap_manager = new(memory_manager_buf) BitmapMemoryManager;
     const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
     uintptr_t available_end = 0; // 最後の未使用領域の末尾アドレス
     for(uintptr_t iter = memory_map_base; iter < memory_map_base + memory_map.map_size; 
@@ -94,26 +207,111 @@ void InitializeMemoryManager(const MemoryMap& memory_map) {
         // 歯抜けの空間は全て使用済みと判断
         // メモリマップのエントリは、物理アドレスの昇順で並べられているはず
         if(available_end < desc->physical_start) {
-            memory_manager->MarkAllocated(
+            bitmap_manager->MarkAllocated(
                     FrameID{available_end / kBytesPerFrame},
                     (desc->physical_start - available_end) / kBytesPerFrame);
         }
         const auto physical_end = desc->physical_start + desc->number_of_pages * kUEFIPageSize;
         if(IsAvailable(static_cast<MemoryType>(desc->type))) {
             available_end = physical_end;
+            // UEFI のページテーブルが残っているので、ページングの設定が終わるまで使わない
+            if(IsBootServicesMemory(static_cast<MemoryType>(desc->type))) {
+                bitmap_manager->MarkAllocated(
+                        FrameID{desc->physical_start / kBytesPerFrame},
+                        desc->number_of_pages * kUEFIPageSize / kBytesPerFrame);
+            }
         }
         else {
-            memory_manager->MarkAllocated(
+            // ACPI のテーブルを読み終えたら ReclaimACPIMemory で解放される
+            if(static_cast<MemoryType>(desc->type) == MemoryType::kEfiACPIReclaimMemory) {
+                available_end = physical_end;
+            }
+            bitmap_manager->MarkAllocated(
                     FrameID{desc->physical_start / kBytesPerFrame},
                     desc->number_of_pages * kUEFIPageSize / kBytesPerFrame);
         }
     }
-    memory_manager->SetMemoryRange(FrameID{1}, FrameID{available_end / kBytesPerFrame});
+    bitmap_manager->SetMemoryRange(FrameID{kLowMemoryEnd / kBytesPerFrame},
+                                   FrameID{available_end / kBytesPerFrame});
+    return bitmap_manager;
+}
 
-    // Initialize Heap
-    if(auto err = InitializeHeap(*memory_manager)) {
-        Log(kError, "failed to allocate pages: %s at %s:%d\n",
+MemoryManager* InitializeBuddyMemoryManager(const MemoryMap& memory_map) {
+    auto buddy_manager = new(memory_manager_buf) BuddyMemoryManager;
+    if(auto err = buddy_manager->Initialize(memory_map)) {
+        Log(kError, "failed to initialize buddy memory manager: %s at %s:%d\n",
             err.Name(), err.File(), err.Line());
         exit(1);
     }
+    return buddy_manager;
+}
+
+}
+
+void InitializeMemoryManager(const MemoryMap& memory_map, MemoryManagerType type) {
+    memory_manager_type = type;
+    switch(type) {
+    case MemoryManagerType::kBitmap:
+        ::memory_manager = InitializeBitmapMemoryManager(memory_map);
+        break;
+    case MemoryManagerType::kBuddy:
+        ::memory_manager = InitializeBuddyMemoryManager(memory_map);
+        break;
+    }
+
+}
+
+size_t ReclaimMemory(uintptr_t begin, uintptr_t end) {
+    // 範囲に完全に含まれるフレームだけを解放する
+    // 1 MiB 未満（ヌルポインタと区別できないフレーム 0 を含む）は使わない
+    const size_t begin_frame = std::max<size_t>((begin + kBytesPerFrame - 1) / kBytesPerFrame,
+                                                kLowMemoryEnd / kBytesPerFrame);
+    const size_t end_frame = end / kBytesPerFrame;
+    if(begin_frame >= end_frame) {
+        return 0;
+    }
+    memory_manager->Free(FrameID{begin_frame}, end_frame - begin_frame);
+    reclaimed_frames += end_frame - begin_frame;
+    return end_frame - begin_frame;
+}
+
+size_t ReleaseBootServicesMemory(const MemoryMap& memory_map) {
+    return ReclaimMemoryOfType(memory_map, IsBootServicesMemory);
+}
+
+size_t ReclaimACPIMemory(const MemoryMap& memory_map) {
+    return ReclaimMemoryOfType(memory_map, [](MemoryType type) {
+        return type == MemoryType::kEfiACPIReclaimMemory;
+    });
+}
+
+size_t ReclaimedFrames() {
+    return reclaimed_frames;
+}
+
+// sbrk から呼ばれ、ヒープが足りなくなった時にフレームを追加で確保する
+// 直前のチャンクと連続していなくても、newlib の malloc は別領域として扱える
+extern "C" int ExtendHeap(int incr) {
+    if(memory_manager == nullptr || incr <= 0) {
+        return -1;
+    }
+
+    const size_t num_frames = std::max<size_t>(
+        kHeapChunkFrames, (incr + kBytesPerFrame - 1) / kBytesPerFrame);
+    const auto chunk = memory_manager->Allocate(num_frames);
+    if(chunk.error) {
+        return -1;
+    }
+
+    const auto chunk_start = reinterpret_cast<caddr_t>(chunk.value.Frame());
+    if(chunk_start != program_break_end) {
+        program_break = chunk_start;
+    }
+    program_break_end = chunk_start + num_frames * kBytesPerFrame;
+    heap_frames += num_frames;
+    return 0;
+}
+
+HeapStat GetHeapStat() {
+    return {heap_frames, heap_bytes_in_use, heap_high_water_mark};
 }
\ No newline at end of file
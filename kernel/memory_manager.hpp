@@ -5,6 +5,7 @@
 #include "error.hpp"
 #include "logger.hpp"
 #include "memory_map.hpp"
+#include "spinlock.hpp"
 
 namespace {
     constexpr unsigned long long operator"" _KiB(unsigned long long kib) {
@@ -19,6 +20,9 @@ namespace {
 }
 
 static const auto kBytesPerFrame{4_KiB};
+// Memory below 1 MiB is never handed out as frames, so real-mode code such as
+// the AP startup trampoline can use any available page there.
+static const auto kLowMemoryEnd{1_MiB};
 
 class FrameID {
     public:
@@ -30,7 +34,23 @@ class FrameID {
         size_t id_;
 };
 
-class BitmapMemoryManager {
+// Interface of the physical frame allocators.
+class MemoryManager {
+    public:
+        virtual ~MemoryManager() = default;
+        // Allocate a space for specified number of frames and return first frame id.
+        virtual WithError<FrameID> Allocate(size_t num_frames) = 0;
+        virtual Error Free(FrameID start_frame, size_t num_frames) = 0;
+        virtual void MarkAllocated(FrameID start_frame, size_t num_frames) = 0;
+        LockStats LockContention() const { return lock_.Stats(); }
+
+    protected:
+        // Taken by Allocate, Free and MarkAllocated. They may be called from
+        // any CPU and, through the slab allocator, from interrupt handlers.
+        SpinLock lock_;
+};
+
+class BitmapMemoryManager : public MemoryManager {
     public:
         static const auto kMaxPhysicalMemoryBytes{128_GiB};
         static const auto kFrameCount{kMaxPhysicalMemoryBytes / kBytesPerFrame};
@@ -40,23 +60,71 @@ class BitmapMemoryManager {
 
         BitmapMemoryManager();
 
-        // Allocate a space for specified number of frames and return first frame id.
-        WithError<FrameID> Allocate(size_t num_frames);
-        Error Free(FrameID start_frame, size_t num_frames);
-        void MarkAllocated(FrameID start_frame, size_t num_frames);
+        WithError<FrameID> Allocate(size_t num_frames) override;
+        Error Free(FrameID start_frame, size_t num_frames) override;
+        void MarkAllocated(FrameID start_frame, size_t num_frames) override;
 
         // Set the memory range that this memory manager handls.
         void SetMemoryRange(FrameID range_begin, FrameID range_end);
 
+        // The former search: test one bit at a time, always from range_begin_.
+        // Kept only so that allocbench can compare it with Allocate.
+        WithError<FrameID> AllocateFirstFit(size_t num_frames);
+
         private:
             // 1bit == 1 page frame 
             std::array<MapLineType, kFrameCount / kBitsPerMapLine> alloc_map_;
+            // 1bit == 1 map line, set when every frame of the line is allocated
+            std::array<MapLineType, kFrameCount / kBitsPerMapLine / kBitsPerMapLine> full_map_;
             FrameID range_begin_;
             FrameID range_end_;
+            FrameID hint_; // next-fit: the search starts from here
             bool GetBit(FrameID) const;
-            void SetBit(FrameID frame, bool allocated);
+            void SetBits(FrameID start_frame, size_t num_frames, bool allocated);
+            void UpdateFullMap(size_t line_index);
+            size_t FindFreeFrame(size_t begin, size_t end) const;
+            size_t FindAllocatedFrame(size_t begin, size_t end) const;
+            WithError<FrameID> AllocateIn(size_t begin, size_t end, size_t num_frames);
 };
 
 static const FrameID kNullFrame{std::numeric_limits<size_t>::max()};
 
-void InitializeMemoryManager(const MemoryMap& memory_map);
\ No newline at end of file
+enum class MemoryManagerType {
+    kBitmap,
+    kBuddy,
+};
+
+// Chosen at build time: make FRAME_ALLOCATOR=bitmap selects the bitmap allocator.
+#ifdef FRAME_ALLOCATOR_BITMAP
+static const auto kDefaultMemoryManagerType{MemoryManagerType::kBitmap};
+#else
+static const auto kDefaultMemoryManagerType{MemoryManagerType::kBuddy};
+#endif
+
+extern MemoryManager* memory_manager;
+extern MemoryManagerType memory_manager_type;
+
+void InitializeMemoryManager(const MemoryMap& memory_map,
+                             MemoryManagerType type = kDefaultMemoryManagerType);
+
+// Free the frames that lie entirely within [begin, end) and count them as
+// reclaimed. Returns the number of frames freed.
+size_t ReclaimMemory(uintptr_t begin, uintptr_t end);
+
+// Boot services memory holds the page tables set up by UEFI, so it is kept
+// allocated by InitializeMemoryManager and given back once CR3 points to ours.
+size_t ReleaseBootServicesMemory(const MemoryMap& memory_map);
+
+// Free the ACPI reclaim memory. The tables must have been copied beforehand.
+size_t ReclaimACPIMemory(const MemoryMap& memory_map);
+
+// Total number of frames given back by the functions above.
+size_t ReclaimedFrames();
+
+struct HeapStat {
+    size_t frames;          // frames reserved for the sbrk heap
+    size_t bytes_in_use;    // bytes handed out by sbrk
+    size_t high_water_mark; // peak of bytes_in_use
+};
+
+HeapStat GetHeapStat();
\ No newline at end of file
@@ -52,6 +52,10 @@ inline bool IsAvailable(MemoryType memory_type) {
            memory_type == MemoryType::kEfiBootServicesData ||
            memory_type == MemoryType::kEfiConventionalMemory;
 }
+inline bool IsBootServicesMemory(MemoryType memory_type) {
+    return memory_type == MemoryType::kEfiBootServicesCode ||
+           memory_type == MemoryType::kEfiBootServicesData;
+}
 const int kUEFIPageSize = 4096;
 
 #endif
@@ -0,0 +1,69 @@
+#include "mutex.hpp"
+#include "task.hpp"
+
+void Mutex::Lock() {
+    Task& self = task_manager->CurrentTask();
+    Waiter waiter{&self, nullptr};
+    {
+        SpinLockGuard guard{lock_};
+        ++acquisitions_;
+        if(owner_ == nullptr) {
+            owner_ = &self;
+            return;
+        }
+        ++contentions_;
+        if(tail_) {
+            tail_->next = &waiter;
+        }
+        else {
+            head_ = &waiter;
+        }
+        tail_ = &waiter;
+    }
+
+    // メッセージでも起こされるので、所有権を渡されるまで眠り直す。
+    // 確かめてから Sleep するまでに Wakeup されても、その Sleep は取り消される
+    while(true) {
+        {
+            SpinLockGuard guard{lock_};
+            if(owner_ == &self) {
+                return;
+            }
+            ++sleeps_;
+        }
+        self.Sleep();
+    }
+}
+
+bool Mutex::TryLock() {
+    SpinLockGuard guard{lock_};
+    if(owner_ != nullptr) {
+        return false;
+    }
+    ++acquisitions_;
+    owner_ = &task_manager->CurrentTask();
+    return true;
+}
+
+void Mutex::Unlock() {
+    Task* next = nullptr;
+    {
+        SpinLockGuard guard{lock_};
+        if(head_) {
+            // waiter は Lock が戻ると消えるので、ロックを外す前に読んでおく
+            next = head_->task;
+            head_ = head_->next;
+            if(head_ == nullptr) {
+                tail_ = nullptr;
+            }
+        }
+        owner_ = next;
+    }
+    if(next) {
+        next->Wakeup();
+    }
+}
+
+LockStats Mutex::Stats() const {
+    return {acquisitions_, contentions_, sleeps_};
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "spinlock.hpp"
+
+class Task;
+
+// 待つ間は Sleep する排他ロック。タスクの文脈からだけ使う（割り込みハンドラでは使えない）。
+// Unlock は待っているタスクに直接所有権を渡すので、後から来たタスクに追い越されない。
+class Mutex {
+    public:
+        void Lock();
+        bool TryLock();
+        void Unlock();
+        LockStats Stats() const;
+    private:
+        // 待っているタスクのスタック上に置く
+        struct Waiter {
+            Task* task;
+            Waiter* next;
+        };
+
+        SpinLock lock_; // 以下のメンバを守る
+        Task* owner_{nullptr};
+        Waiter* head_{nullptr};
+        Waiter* tail_{nullptr};
+        uint64_t acquisitions_{0};
+        uint64_t contentions_{0};
+        uint64_t sleeps_{0};
+};
@@ -7,15 +7,24 @@ void _exit(void) {
 }
 
 caddr_t program_break, program_break_end;
+size_t heap_bytes_in_use, heap_high_water_mark;
+
+int ExtendHeap(int incr);
 
 caddr_t sbrk(int incr) {
   if (program_break == 0 || program_break + incr >= program_break_end) {
-    errno = ENOMEM;
-    return (caddr_t)-1;
+    if (ExtendHeap(incr) != 0) {
+      errno = ENOMEM;
+      return (caddr_t)-1;
+    }
   }
 
   caddr_t prev_break = program_break;
   program_break += incr;
+  heap_bytes_in_use += incr;
+  if (heap_bytes_in_use > heap_high_water_mark) {
+    heap_high_water_mark = heap_bytes_in_use;
+  }
   return prev_break;
 }
 
@@ -1,33 +1,761 @@
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <map>
 
 #include "paging.hpp"
 #include "asmfunc.h"
+#include "graphics.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
 
 namespace {
     const uint64_t kPageSize4K = 4096;
-    const uint64_t kPageSize2M = 512 * kPageSize4K;
-    const uint64_t kPageSize1G = 512 * kPageSize2M;
 
-    alignas(kPageSize4K) std::array<uint64_t, 512> pml4_table; // 4096の倍数アドレスにアラインメント(下位3bitは0)
-    alignas(kPageSize4K) std::array<uint64_t, 512> pdp_table;
-    alignas(kPageSize4K) 
-        std::array<std::array<uint64_t, 512>, kPageDirectoryCount> page_directory;
+    const uint64_t kAddressMask = 0x000ffffffffff000;
+    const uint64_t kAttributeMask = kPageWritable | kPageUser | kPageWriteThrough |
+                                    kPageCacheDisable | kPageGlobal;
+    const uint64_t kLocalAPICBase = 0xfee00000;
+    const uint32_t kIA32PAT = 0x277;
+
+    const uint64_t kCR3NoFlush = static_cast<uint64_t>(1) << 63;
+    const uint64_t kCR3PCIDMask = 0xfff;
+    const uint64_t kCR4PGE = 1u << 7;
+    const uint64_t kCR4PCIDE = 1u << 17;
+
+    // PML4 の前半はカーネルの恒等写像で、全てのアドレス空間で共有する
+    const int kUserPML4Index = 256;
+
+    uint64_t* kernel_pml4_table = nullptr;
+    bool support_1g_pages = false;
+    bool support_pat = false;
+    bool pcid_enabled = false;
+
+    // アドレス空間の PML4 を、その PCID（PCID 非対応なら単なる番号）で引く表
+    // 0 番はカーネルのアドレス空間
+    std::array<uint64_t*, kMaxAddressSpaces> address_spaces{};
+
+    // カーネル側に新しく作った PML4 エントリを全てのアドレス空間に反映する
+    void ShareKernelEntry(int index) {
+        for(size_t i = 1; i < address_spaces.size(); i++) {
+            if(address_spaces[i]) {
+                address_spaces[i][index] = kernel_pml4_table[index];
+            }
+        }
+    }
+
+    // level 4: PML4, 3: PDPT, 2: PD, 1: PT
+    uint64_t PageSizeOf(int level) {
+        return kPageSize4K << (9 * (level - 1));
+    }
+
+    int IndexOf(uint64_t addr, int level) {
+        return (addr >> (12 + 9 * (level - 1))) & 0x1ffu;
+    }
+
+    bool IsLeaf(uint64_t entry, int level) {
+        return level == 1 || (entry & kPageLarge);
+    }
+
+    uint64_t* TableOf(uint64_t entry) {
+        return reinterpret_cast<uint64_t*>(entry & kAddressMask);
+    }
+
+    WithError<uint64_t*> NewPageTable() {
+        auto frame = memory_manager->Allocate(1);
+        if(frame.error) {
+            return {nullptr, frame.error};
+        }
+        auto table = reinterpret_cast<uint64_t*>(frame.value.Frame());
+        memset(table, 0, kPageSize4K);
+        return {table, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    uint64_t MakeLeaf(uint64_t addr, int level, uint64_t attr) {
+        return addr | attr | kPagePresent | (level > 1 ? kPageLarge : 0);
+    }
+
+    // 大きなページを、同じ属性を持つ1段小さいページの表に置き換える
+    Error SplitLargePage(uint64_t& entry, int level) {
+        auto [ table, err ] = NewPageTable();
+        if(err) {
+            return err;
+        }
+        const uint64_t base = entry & kAddressMask & ~(PageSizeOf(level) - 1);
+        const uint64_t attr = entry & kAttributeMask;
+        for(int i = 0; i < 512; i++) {
+            table[i] = MakeLeaf(base + i * PageSizeOf(level - 1), level - 1, attr);
+        }
+        entry = reinterpret_cast<uint64_t>(table) | kPagePresent | kPageWritable;
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    // MapRange で既存のエントリを書き換えたか（現在の CR3 以外の TLB を消すために使う）
+    bool present_entry_changed = false;
+
+    // 仮想アドレス [addr, end) を物理アドレス addr + delta 以降に対応付ける
+    Error MapRange(uint64_t* table, int level, uint64_t addr, uint64_t end,
+                   uint64_t delta, uint64_t attr) {
+        const uint64_t page_size = PageSizeOf(level);
+        while(addr < end) {
+            const int index = IndexOf(addr, level);
+            auto& entry = table[index];
+            const uint64_t page_end = (addr & ~(page_size - 1)) + page_size;
+            const uint64_t next = std::min(page_end, end);
+            const bool whole_page = (addr & (page_size - 1)) == 0 && next == page_end;
+            const bool can_be_leaf = level == 1 || (level == 2 && (delta & (page_size - 1)) == 0) ||
+                                     (level == 3 && support_1g_pages && (delta & (page_size - 1)) == 0);
+            const uint64_t phys_base = (addr + delta) & ~(page_size - 1);
+
+            if(whole_page && can_be_leaf && !((entry & kPagePresent) && !IsLeaf(entry, level))) {
+                const uint64_t new_entry = MakeLeaf(addr + delta, level, attr);
+                if(entry != new_entry) {
+                    const bool was_present = entry & kPagePresent;
+                    entry = new_entry;
+                    if(was_present) {
+                        present_entry_changed = true;
+                        InvalidateTLB(addr);
+                    }
+                }
+            }
+            else if((entry & kPagePresent) && IsLeaf(entry, level) &&
+                    (entry & kAddressMask & ~(page_size - 1)) == phys_base &&
+                    (entry & kAttributeMask) == attr) {
+                // 同じ属性で既にマップされている
+            }
+            else {
+                if((entry & kPagePresent) == 0) {
+                    auto [ child, err ] = NewPageTable();
+                    if(err) {
+                        return err;
+                    }
+                    entry = reinterpret_cast<uint64_t>(child) | kPagePresent | kPageWritable;
+                    if(level == 4 && table == kernel_pml4_table && index < kUserPML4Index) {
+                        ShareKernelEntry(index);
+                    }
+                }
+                else if(IsLeaf(entry, level)) {
+                    if(auto err = SplitLargePage(entry, level)) {
+                        return err;
+                    }
+                }
+                if(auto err = MapRange(TableOf(entry), level - 1, addr, next, delta, attr)) {
+                    return err;
+                }
+            }
+            addr = next;
+        }
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    // ページテーブルを再帰的に解放する（マップ先のフレームは解放しない）
+    void FreeTables(uint64_t* table, int level) {
+        for(int i = 0; i < 512; i++) {
+            if(level > 1 && (table[i] & kPagePresent) && !IsLeaf(table[i], level)) {
+                FreeTables(TableOf(table[i]), level - 1);
+            }
+        }
+        memory_manager->Free(FrameID{reinterpret_cast<uint64_t>(table) / kPageSize4K}, 1);
+    }
+
+    // TLB に残っている、指定したアドレス空間の PCID のエントリを消す
+    void FlushAddressSpace(uint64_t cr3) {
+        if(!pcid_enabled) {
+            return; // CR3 の再ロードで消える
+        }
+        const uint64_t current = GetCR3();
+        SetCR3(cr3 & ~kCR3NoFlush);
+        SetCR3(current | kCR3NoFlush);
+    }
+
+    // 他の CPU の TLB を消す要求（shootdown）。cr3 が 0 でなければそのアドレス空間の全体、
+    // 0 ならカーネルの [begin, end)（グローバルなエントリを含む）
+    struct ShootdownRequest {
+        uint64_t begin, end;
+        uint64_t cr3;
+    };
+
+    // 送る側は shootdown_lock を持ち、対象の CPU のビットを立てて IPI を送り、全て消えるまで待つ
+    SpinLock shootdown_lock;
+    ShootdownRequest shootdown_request;
+    std::atomic<uint64_t> shootdown_pending{0}; // bit n: CPU n がまだ消していない
+    // これより多くのページなら invlpg を並べず、グローバルなエントリも含めて全て消す
+    const uint64_t kShootdownMaxPages = 64;
+
+    void FlushLocal(const ShootdownRequest& req) {
+        if(req.cr3 != 0) {
+            if(pcid_enabled) {
+                FlushAddressSpace(req.cr3);
+            }
+            else if((GetCR3() & kAddressMask) == (req.cr3 & kAddressMask)) {
+                SetCR3(GetCR3()); // PCID がなければ CR3 の再ロードで消える
+            }
+            return;
+        }
+        if((req.end - req.begin) / kPageSize4K > kShootdownMaxPages) {
+            const uint64_t cr4 = GetCR4();
+            SetCR4(cr4 & ~kCR4PGE); // PGE を落とすとグローバルなエントリも消える
+            SetCR4(cr4);
+            return;
+        }
+        for(uint64_t page = req.begin; page < req.end; page += kPageSize4K) {
+            InvalidateTLB(page); // invlpg はグローバルなエントリも消す
+        }
+    }
+
+    // 自分宛ての要求があれば処理する。割り込み禁止で呼ぶ
+    void ServiceShootdown() {
+        const uint64_t bit = static_cast<uint64_t>(1) << CurrentCPU();
+        if((shootdown_pending.load(std::memory_order_acquire) & bit) == 0) {
+            return;
+        }
+        FlushLocal(shootdown_request);
+        shootdown_pending.fetch_and(~bit, std::memory_order_release);
+    }
+
+    // 全ての CPU の TLB から req の範囲を消し、終わるまで待つ。
+    // スピンロックを持ったまま呼んではいけない（相手がそのロックを待って割り込み禁止で回っていると、
+    // いつまでも応答しない）。待っている間も自分宛ての要求を処理するので、同時に送り合っても止まらない
+    void Shootdown(const ShootdownRequest& req) {
+        InterruptGuard guard;
+        FlushLocal(req);
+        if(num_cpus <= 1) {
+            return;
+        }
+
+        while(!shootdown_lock.TryLock()) {
+            ServiceShootdown();
+            __builtin_ia32_pause();
+        }
+        shootdown_request = req;
+        const int self = CurrentCPU();
+        uint64_t targets = 0;
+        for(int cpu = 0; cpu < num_cpus; ++cpu) {
+            if(cpu != self && cpus[cpu].online.load(std::memory_order_acquire)) {
+                targets |= static_cast<uint64_t>(1) << cpu;
+            }
+        }
+        shootdown_pending.store(targets, std::memory_order_release);
+        for(uint64_t rest = targets; rest; rest &= rest - 1) {
+            SendIPI(__builtin_ctzll(rest), InterruptVector::kTLBShootdown);
+        }
+        while(shootdown_pending.load(std::memory_order_acquire) != 0) {
+            __builtin_ia32_pause();
+        }
+        shootdown_lock.Unlock();
+    }
+
+    // 要求時ゼロ領域：PML4 エントリ 255 の 512GiB（物理メモリの恒等写像とは重ならない）
+    // カーネル側の半分なので全てのアドレス空間から見える
+    const uint64_t kDemandAreaBase = static_cast<uint64_t>(kUserPML4Index - 1) << 39;
+    const uint64_t kDemandAreaEnd = static_cast<uint64_t>(kUserPML4Index) << 39;
+
+    // 存在しないエントリ・読み取り専用エントリに置くソフトウェア用ビット
+    const uint64_t kPageDemandZero = 0x200;
+    const uint64_t kPageCopyOnWrite = 0x400;
+    const uint64_t kPageGuard = 0x800;
+    // ReleaseDemandZero が外したが、他の CPU の TLB を消すまでフレームを解放しないエントリ
+    const uint64_t kPageReleasing = static_cast<uint64_t>(1) << 52;
+
+    const uint64_t kFaultPresent = 0x01;
+    const uint64_t kFaultWrite = 0x02;
+
+    // 未使用の仮想アドレス範囲（先頭 -> 末尾）
+    std::map<uint64_t, uint64_t>* free_demand_ranges = nullptr;
+
+    // 複数の領域から共有されているフレームと、その共有数
+    std::map<uint64_t, uint64_t>* cow_share_counts = nullptr;
+
+    // 要求時ゼロ領域のエントリと上の 2 つを守る。ページフォールトハンドラも取るので、
+    // 持っている間に要求時ゼロ領域に触ってはいけない
+    SpinLock demand_lock;
+
+    // addr に対応する 4KiB ページのエントリ（create なら途中の表を作る）
+    WithError<uint64_t*> DemandAreaEntry(uint64_t addr, bool create) {
+        uint64_t* table = kernel_pml4_table;
+        for(int level = 4; level > 1; --level) {
+            const int index = IndexOf(addr, level);
+            auto& entry = table[index];
+            if((entry & kPagePresent) == 0) {
+                if(!create) {
+                    return {nullptr, MAKE_ERROR(Error::kIndexOutOfRange)};
+                }
+                auto [ child, err ] = NewPageTable();
+                if(err) {
+                    return {nullptr, err};
+                }
+                entry = reinterpret_cast<uint64_t>(child) | kPagePresent | kPageWritable;
+                if(level == 4) {
+                    ShareKernelEntry(index);
+                }
+            }
+            table = TableOf(entry);
+        }
+        return {&table[IndexOf(addr, 1)], MAKE_ERROR(Error::kSuccess)};
+    }
+
+    bool InDemandArea(uint64_t addr, size_t bytes) {
+        return kDemandAreaBase <= addr && addr + bytes <= kDemandAreaEnd && addr + bytes >= addr;
+    }
+
+    WithError<uint64_t> AllocateDemandRange(size_t bytes) {
+        if(free_demand_ranges == nullptr) {
+            free_demand_ranges = new std::map<uint64_t, uint64_t>;
+            cow_share_counts = new std::map<uint64_t, uint64_t>;
+            (*free_demand_ranges)[kDemandAreaBase] = kDemandAreaEnd;
+        }
+        for(auto it = free_demand_ranges->begin(); it != free_demand_ranges->end(); ++it) {
+            const auto [ begin, end ] = *it;
+            if(end - begin < bytes) {
+                continue;
+            }
+            free_demand_ranges->erase(it);
+            if(begin + bytes < end) {
+                (*free_demand_ranges)[begin + bytes] = end;
+            }
+            return {begin, MAKE_ERROR(Error::kSuccess)};
+        }
+        return {0, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    void FreeDemandRange(uint64_t begin, uint64_t end) {
+        auto next = free_demand_ranges->lower_bound(begin);
+        if(next != free_demand_ranges->end() && next->first == end) {
+            end = next->second;
+            next = free_demand_ranges->erase(next);
+        }
+        if(next != free_demand_ranges->begin()) {
+            auto prev = std::prev(next);
+            if(prev->second == begin) {
+                prev->second = end;
+                return;
+            }
+        }
+        (*free_demand_ranges)[begin] = end;
+    }
+
+    // 共有数を 1 減らし、まだ他の領域から使われていれば true
+    bool DropCopyOnWriteShare(uint64_t frame) {
+        auto it = cow_share_counts->find(frame);
+        if(it == cow_share_counts->end()) {
+            return false;
+        }
+        if(--it->second == 1) {
+            cow_share_counts->erase(it);
+        }
+        return true;
+    }
+
+    Error HandleDemandZero(uint64_t& entry) {
+        auto frame = memory_manager->Allocate(1);
+        if(frame.error) {
+            return frame.error;
+        }
+        memset(frame.value.Frame(), 0, kPageSize4K);
+        entry = reinterpret_cast<uint64_t>(frame.value.Frame()) |
+                kPagePresent | kPageWritable | kPageGlobal;
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    // フレームを複製して付け替えたら copied を true にする（呼び出し側が他の CPU の TLB を消す）
+    Error HandleCopyOnWrite(uint64_t& entry, uint64_t addr, bool& copied) {
+        const uint64_t shared = entry & kAddressMask;
+        uint64_t frame_addr = shared;
+        if(cow_share_counts->count(shared)) {
+            auto frame = memory_manager->Allocate(1);
+            if(frame.error) {
+                return frame.error;
+            }
+            memcpy(frame.value.Frame(), reinterpret_cast<void*>(shared), kPageSize4K);
+            frame_addr = reinterpret_cast<uint64_t>(frame.value.Frame());
+            DropCopyOnWriteShare(shared);
+            copied = true;
+        }
+        // 最後の 1 つになったフレームはコピーせずそのまま書き込み可能にする
+        entry = frame_addr | kPagePresent | kPageWritable | kPageGlobal;
+        InvalidateTLB(addr);
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    // demand_lock を取った状態で呼ぶ。TLB はこの CPU の分しか消さないので、
+    // 他の CPU にまだ見せていない範囲（予約に失敗したときの後始末）にだけ使う
+    void ReleaseDemandPages(uint64_t addr, size_t bytes) {
+        for(uint64_t page = addr; page < addr + bytes; page += kPageSize4K) {
+            auto [ entry, err ] = DemandAreaEntry(page, false);
+            if(err) {
+                continue;
+            }
+            if(*entry & kPagePresent) {
+                const uint64_t frame = *entry & kAddressMask;
+                if(!((*entry & kPageCopyOnWrite) && DropCopyOnWriteShare(frame))) {
+                    memory_manager->Free(FrameID{frame / kPageSize4K}, 1);
+                }
+                InvalidateTLB(page);
+            }
+            *entry = 0;
+        }
+        FreeDemandRange(addr, addr + bytes);
+    }
+
+    bool Supports1GPages() {
+        uint32_t eax, ebx, ecx, edx;
+        ReadCPUID(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+        if(eax < 0x80000001) {
+            return false;
+        }
+        ReadCPUID(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        return (edx >> 26) & 1;  // Page1GB
+    }
+
+    bool SupportsPAT() {
+        uint32_t eax, ebx, ecx, edx;
+        ReadCPUID(1, 0, &eax, &ebx, &ecx, &edx);
+        return (edx >> 16) & 1;
+    }
+
+    // 電源投入時の値 (WB, WT, UC-, UC) のうち、エントリ1の WT を WC に置き換える
+    void SetupPAT() {
+        const uint64_t kMemoryTypeWC = 0x01;
+        uint64_t pat = ReadMSR(kIA32PAT);
+        pat = (pat & ~(static_cast<uint64_t>(0xff) << 8)) | (kMemoryTypeWC << 8);
+        WriteMSR(kIA32PAT, pat);
+    }
+
+    uint64_t AttributeOf(MemoryType type) {
+        if(type == MemoryType::kEfiMemoryMappedIO ||
+           type == MemoryType::kEfiMemoryMappedIOPortSpace) {
+            return kPageWritable | kPageCacheDisable;
+        }
+        return kPageWritable;
+    }
+
+    // 隣接し属性の等しい記述子をまとめてマップし、大きなページを使いやすくする
+    Error MapMemoryMap(const MemoryMap& memory_map) {
+        uint64_t run_begin = 0, run_end = 0, run_attr = 0;
+        const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
+        for(uintptr_t iter = memory_map_base; iter < memory_map_base + memory_map.map_size;
+            iter += memory_map.descriptor_size) {
+            auto desc = reinterpret_cast<const MemoryDescriptor*>(iter);
+            const uint64_t begin = desc->physical_start;
+            const uint64_t end = begin + desc->number_of_pages * kUEFIPageSize;
+            const uint64_t attr = AttributeOf(static_cast<MemoryType>(desc->type));
+            if(begin == run_end && attr == run_attr) {
+                run_end = end;
+                continue;
+            }
+            if(run_begin < run_end) {
+                if(auto err = MapIdentity(run_begin, run_end - run_begin, run_attr)) {
+                    return err;
+                }
+            }
+            run_begin = begin;
+            run_end = end;
+            run_attr = attr;
+        }
+        if(run_begin < run_end) {
+            return MapIdentity(run_begin, run_end - run_begin, run_attr);
+        }
+        return MAKE_ERROR(Error::kSuccess);
+    }
+}
+
+Error MapIdentity(uint64_t addr, size_t bytes, uint64_t attr) {
+    const uint64_t begin = addr & ~(kPageSize4K - 1);
+    const uint64_t end = (addr + bytes + kPageSize4K - 1) & ~(kPageSize4K - 1);
+    // カーネルの写像は全アドレス空間で同じなので、グローバルにして CR3 切り替えで消えないようにする
+    return MapRange(kernel_pml4_table, 4, begin, end, 0, (attr & kAttributeMask) | kPageGlobal);
+}
+
+uint64_t KernelCR3() {
+    return reinterpret_cast<uint64_t>(kernel_pml4_table) | (pcid_enabled ? kCR3NoFlush : 0);
+}
+
+WithError<uint64_t> NewAddressSpace() {
+    size_t id = 1;
+    while(id < address_spaces.size() && address_spaces[id]) {
+        ++id;
+    }
+    if(id == address_spaces.size()) {
+        return {0, MAKE_ERROR(Error::kFull)};
+    }
+
+    auto [ pml4, err ] = NewPageTable();
+    if(err) {
+        return {0, err};
+    }
+    for(int i = 0; i < kUserPML4Index; i++) {
+        pml4[i] = kernel_pml4_table[i];
+    }
+    address_spaces[id] = pml4;
+
+    uint64_t cr3 = reinterpret_cast<uint64_t>(pml4);
+    if(pcid_enabled) {
+        // 以前この PCID を使っていた空間のエントリは FreeAddressSpace で消してある
+        cr3 |= id | kCR3NoFlush;
+    }
+    return {cr3, MAKE_ERROR(Error::kSuccess)};
+}
+
+void HandleTLBShootdown() {
+    ServiceShootdown();
+}
+
+void FreeAddressSpace(uint64_t cr3) {
+    auto pml4 = reinterpret_cast<uint64_t*>(cr3 & kAddressMask);
+    if(pml4 == kernel_pml4_table) {
+        return;
+    }
+    for(size_t id = 1; id < address_spaces.size(); id++) {
+        if(address_spaces[id] == pml4) {
+            address_spaces[id] = nullptr;
+        }
+    }
+
+    // PCID を再利用する前に、このアドレス空間を使った全ての CPU から消す
+    Shootdown({0, 0, cr3});
+    for(int i = kUserPML4Index; i < 512; i++) {
+        if(pml4[i] & kPagePresent) {
+            FreeTables(TableOf(pml4[i]), 3);
+        }
+    }
+    memory_manager->Free(FrameID{reinterpret_cast<uint64_t>(pml4) / kPageSize4K}, 1);
+}
+
+Error MapPages(uint64_t cr3, uint64_t virt, uint64_t phys, size_t bytes, uint64_t attr) {
+    const uint64_t begin = virt & ~(kPageSize4K - 1);
+    const uint64_t end = (virt + bytes + kPageSize4K - 1) & ~(kPageSize4K - 1);
+    if(IndexOf(begin, 4) < kUserPML4Index || (phys & (kPageSize4K - 1)) != (virt & (kPageSize4K - 1))) {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    auto pml4 = reinterpret_cast<uint64_t*>(cr3 & kAddressMask);
+    present_entry_changed = false;
+    auto err = MapRange(pml4, 4, begin, end, phys - virt, attr & kAttributeMask & ~kPageGlobal);
+    if(present_entry_changed) {
+        // invlpg は現在の PCID のエントリしか消さず、他の CPU でこの空間が使われていることもある
+        Shootdown({0, 0, cr3});
+    }
+    return err;
 }
 
-void SetupIdentityPageTable() {
-    pml4_table[0] = reinterpret_cast<uint64_t>(&pdp_table) | 0x003;
-    for(int i_pdpt = 0; i_pdpt < page_directory.size(); i_pdpt++) {
-        pdp_table[i_pdpt] = reinterpret_cast<uint64_t>(&page_directory[i_pdpt]) | 0x003;
-        //  Normally, element of Page directory are address to the Page table, 
-        //  but, in the case of 2MiB page, we can directly specify the physical address of the 2MiB page.
-        for(int i_pd = 0 ; i_pd < 512; i_pd++) {
-            page_directory[i_pdpt][i_pd] = i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x083;
+WithError<uint64_t> ReserveDemandZero(size_t bytes) {
+    bytes = (bytes + kPageSize4K - 1) & ~(kPageSize4K - 1);
+    SpinLockGuard guard{demand_lock};
+    auto [ addr, err ] = AllocateDemandRange(bytes);
+    if(err) {
+        return {0, err};
+    }
+    for(uint64_t page = addr; page < addr + bytes; page += kPageSize4K) {
+        auto [ entry, entry_err ] = DemandAreaEntry(page, true);
+        if(entry_err) {
+            ReleaseDemandPages(addr, page - addr);
+            FreeDemandRange(page, addr + bytes);
+            return {0, entry_err};
+        }
+        *entry = kPageDemandZero;
+    }
+    return {addr, MAKE_ERROR(Error::kSuccess)};
+}
+
+// スタックは要求時ゼロにしない。demand_lock やメモリマネージャのロックを持っている間に
+// スタックが未割り当てのページに伸びると、ページフォールトハンドラでデッドロックする
+WithError<uint64_t> ReserveGuarded(size_t bytes, size_t guard_bytes) {
+    bytes = (bytes + kPageSize4K - 1) & ~(kPageSize4K - 1);
+    guard_bytes = (guard_bytes + kPageSize4K - 1) & ~(kPageSize4K - 1);
+    SpinLockGuard guard{demand_lock};
+    auto [ addr, err ] = AllocateDemandRange(guard_bytes + bytes);
+    if(err) {
+        return {0, err};
+    }
+    const uint64_t end = addr + guard_bytes + bytes;
+    for(uint64_t page = addr; page < end; page += kPageSize4K) {
+        auto [ entry, entry_err ] = DemandAreaEntry(page, true);
+        if(entry_err) {
+            ReleaseDemandPages(addr, page - addr);
+            FreeDemandRange(page, end);
+            return {0, entry_err};
         }
+        *entry = kPageGuard;
+        if(page < addr + guard_bytes) {
+            continue;
+        }
+        if(auto zero_err = HandleDemandZero(*entry)) {
+            *entry = 0;
+            ReleaseDemandPages(addr, page - addr);
+            FreeDemandRange(page, end);
+            return {0, zero_err};
+        }
+    }
+    return {addr + guard_bytes, MAKE_ERROR(Error::kSuccess)};
+}
+
+void ReleaseDemandZero(uint64_t addr, size_t bytes) {
+    bytes = (bytes + kPageSize4K - 1) & ~(kPageSize4K - 1);
+    if(bytes == 0 || !InDemandArea(addr, bytes)) {
+        return;
     }
+
+    // エントリを外してから全 CPU の TLB を消し、それからフレームと仮想アドレスを返す。
+    // 先に返すと、古いグローバルなエントリを持つ CPU が再利用されたフレームに書き込みうる
+    {
+        SpinLockGuard guard{demand_lock};
+        for(uint64_t page = addr; page < addr + bytes; page += kPageSize4K) {
+            auto [ entry, err ] = DemandAreaEntry(page, false);
+            if(err) {
+                continue;
+            }
+            *entry = (*entry & kPagePresent) ? (*entry & ~kPagePresent) | kPageReleasing : 0;
+        }
+    }
+    Shootdown({addr, addr + bytes, 0});
+
+    SpinLockGuard guard{demand_lock};
+    for(uint64_t page = addr; page < addr + bytes; page += kPageSize4K) {
+        auto [ entry, err ] = DemandAreaEntry(page, false);
+        if(err || (*entry & kPageReleasing) == 0) {
+            continue;
+        }
+        const uint64_t frame = *entry & kAddressMask;
+        if(!((*entry & kPageCopyOnWrite) && DropCopyOnWriteShare(frame))) {
+            memory_manager->Free(FrameID{frame / kPageSize4K}, 1);
+        }
+        *entry = 0;
+    }
+    FreeDemandRange(addr, addr + bytes);
+}
+
+WithError<uint64_t> CloneCopyOnWrite(uint64_t addr, size_t bytes) {
+    bytes = (bytes + kPageSize4K - 1) & ~(kPageSize4K - 1);
+    if(!InDemandArea(addr, bytes) || (addr & (kPageSize4K - 1))) {
+        return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
+    }
+    auto [ clone, err ] = ReserveDemandZero(bytes);
+    if(err) {
+        return {0, err};
+    }
+
+    {
+        SpinLockGuard guard{demand_lock};
+        for(uint64_t offset = 0; offset < bytes; offset += kPageSize4K) {
+            auto [ src, src_err ] = DemandAreaEntry(addr + offset, false);
+            if(src_err || (*src & kPagePresent) == 0) {
+                continue; // まだ触られていないページは複製先でも要求時ゼロのまま
+            }
+            auto [ dst, dst_err ] = DemandAreaEntry(clone + offset, false);
+            const uint64_t frame = *src & kAddressMask;
+            auto& count = (*cow_share_counts)[frame];
+            count = count == 0 ? 2 : count + 1;
+            *src = frame | kPagePresent | kPageGlobal | kPageCopyOnWrite;
+            *dst = *src;
+        }
+    }
+    // 書き込み可能なエントリが他の CPU に残っていると、共有したフレームに書かれてしまう
+    Shootdown({addr, addr + bytes, 0});
+    return {clone, MAKE_ERROR(Error::kSuccess)};
+}
+
+namespace {
+    Error ResolveDemandFault(uint64_t error_code, uint64_t causal_addr, bool& copied) {
+        SpinLockGuard guard{demand_lock};
+        auto [ entry, err ] = DemandAreaEntry(causal_addr, false);
+        if(err) {
+            return err;
+        }
+
+        // 同じページで他の CPU が先にフォールトを処理した
+        if((*entry & kPagePresent) && ((error_code & kFaultWrite) == 0 || (*entry & kPageWritable))) {
+            InvalidateTLB(causal_addr);
+            return MAKE_ERROR(Error::kSuccess);
+        }
+
+        if((error_code & kFaultPresent) == 0 && (*entry & kPageGuard)) {
+            return MAKE_ERROR(Error::kStackOverflow);
+        }
+        if((error_code & kFaultPresent) == 0 && (*entry & kPageDemandZero)) {
+            return HandleDemandZero(*entry);
+        }
+        if((error_code & kFaultPresent) && (error_code & kFaultWrite) &&
+           (*entry & kPageCopyOnWrite)) {
+            return HandleCopyOnWrite(*entry, causal_addr & ~(kPageSize4K - 1), copied);
+        }
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+}
+
+Error HandlePageFault(uint64_t error_code, uint64_t causal_addr) {
+    if(!InDemandArea(causal_addr, 1)) {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    bool copied = false;
+    auto err = ResolveDemandFault(error_code, causal_addr, copied);
+    if(copied) {
+        // 他の CPU には、まだ共有していたフレームを指すエントリが残っているかもしれない
+        const uint64_t page = causal_addr & ~(kPageSize4K - 1);
+        Shootdown({page, page + kPageSize4K, 0});
+    }
+    return err;
+}
+
+Error SetFrameBufferWriteCombining(bool enable) {
+    const size_t frame_buffer_bytes = static_cast<size_t>(screen_config.pixels_per_scan_line) *
+                                      screen_config.vertical_resolution * 4;
+    const uint64_t attr = enable && support_pat ? kPageWritable | kPageWriteCombining : kPageWritable;
+    if(auto err = MapIdentity(reinterpret_cast<uint64_t>(screen_config.frame_buffer),
+                              frame_buffer_bytes, attr)) {
+        return err;
+    }
+    // 別のメモリタイプでキャッシュされた内容が残らないようにする
+    FlushCache();
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void InitializePaging(const MemoryMap& memory_map) {
+    support_1g_pages = Supports1GPages();
+    support_pat = SupportsPAT();
+    if(support_pat) {
+        SetupPAT();
+    }
+
+    auto [ table, err ] = NewPageTable();
+    if(!err) {
+        kernel_pml4_table = table;
+        address_spaces[0] = table;
+        err = MapMemoryMap(memory_map);
+    }
+    if(!err) {
+        err = SetFrameBufferWriteCombining(true);
+    }
+    if(!err) {
+        err = MapIdentity(kLocalAPICBase, kPageSize4K, kPageWritable | kPageCacheDisable);
+    }
+    if(err) {
+        Log(kError, "failed to build page tables: %s at %s:%d\n",
+            err.Name(), err.File(), err.Line());
+        exit(1);
+    }
+
     // pml4テーブルをレジスタに登録
-    SetCR3(reinterpret_cast<uint64_t>(&pml4_table[0]));
+    SetCR3(reinterpret_cast<uint64_t>(kernel_pml4_table));
+    SetCR4(GetCR4() | kCR4PGE);
+
+    // PCIDE は CR3 の PCID が 0 の状態でしか立てられない
+    uint32_t eax, ebx, ecx, edx;
+    ReadCPUID(1, 0, &eax, &ebx, &ecx, &edx);
+    if((ecx >> 17) & 1) {
+        SetCR4(GetCR4() | kCR4PCIDE);
+        pcid_enabled = true;
+    }
 }
 
-void InitializePaging() {
-    SetupIdentityPageTable();
-}
\ No newline at end of file
+void InitializePagingAP() {
+    if(support_pat) {
+        SetupPAT();
+    }
+    SetCR4(GetCR4() | kCR4PGE | (pcid_enabled ? kCR4PCIDE : 0));
+}
@@ -1,8 +1,79 @@
 # pragma once
 #include <cstddef>
+#include <cstdint>
 
-const size_t kPageDirectoryCount = 64;
+#include "error.hpp"
+#include "memory_map.hpp"
 
-void SetupIdentityPageTable();
+// ページテーブルエントリの属性ビット
+const uint64_t kPagePresent      = 0x001;
+const uint64_t kPageWritable     = 0x002;
+const uint64_t kPageUser         = 0x004;
+const uint64_t kPageWriteThrough = 0x008;
+const uint64_t kPageCacheDisable = 0x010;
+const uint64_t kPageLarge        = 0x080;  // PDPT/PD entry maps 1GiB/2MiB page
+const uint64_t kPageGlobal       = 0x100;
 
-void InitializePaging();
\ No newline at end of file
+// PAT のエントリ1を WC にしているので、PWT だけを立てたページは write-combining になる
+const uint64_t kPageWriteCombining = kPageWriteThrough;
+
+// Identity-map [addr, addr + bytes) with the given attributes.
+// 1GiB/2MiB pages are used wherever the range is aligned, and a large page that
+// only partially overlaps the range is split into smaller ones.
+Error MapIdentity(uint64_t addr, size_t bytes, uint64_t attr = kPageWritable);
+
+// Number of address spaces that can exist at once (the number of PCIDs).
+const size_t kMaxAddressSpaces = 4096;
+
+// CR3 value of the kernel address space.
+uint64_t KernelCR3();
+
+// Create an address space whose lower half (PML4 entries 0-255) is shared with
+// the kernel and whose upper half is private. Returns the value to load into CR3;
+// it carries a PCID and the no-flush bit when the CPU supports PCID.
+WithError<uint64_t> NewAddressSpace();
+
+// Free the page tables of the upper half and the PML4 of the address space.
+// The frames mapped there are not freed.
+void FreeAddressSpace(uint64_t cr3);
+
+// Map [virt, virt + bytes) in the upper half of the address space to phys.
+Error MapPages(uint64_t cr3, uint64_t virt, uint64_t phys, size_t bytes,
+               uint64_t attr = kPageWritable);
+
+// Reserve kernel virtual memory whose pages are backed by zeroed frames on the
+// first access. The reservation is visible from every address space.
+WithError<uint64_t> ReserveDemandZero(size_t bytes);
+
+// Reserve guard_bytes + bytes of kernel virtual memory and return the address
+// guard_bytes above its start. [addr, addr + bytes) is backed by zeroed frames
+// right away; [addr - guard_bytes, addr) is never mapped, and an access to it
+// fails with kStackOverflow. Release the whole range with ReleaseDemandZero.
+WithError<uint64_t> ReserveGuarded(size_t bytes, size_t guard_bytes);
+
+// Unmap a range made by ReserveDemandZero or CloneCopyOnWrite and free its frames.
+void ReleaseDemandZero(uint64_t addr, size_t bytes);
+
+// Make a new reservation that shares the pages of [addr, addr + bytes) read-only.
+// The first write to a shared page, from either side, copies it.
+WithError<uint64_t> CloneCopyOnWrite(uint64_t addr, size_t bytes);
+
+// Resolve a page fault at causal_addr. An error means the access was invalid.
+Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
+
+// Flush this CPU's TLB as requested by another CPU. Called by the kTLBShootdown
+// handler. Unmapping kernel pages, copy-on-write and MapPages flush every online
+// CPU and wait for them, so they must not be called with a spin lock held.
+void HandleTLBShootdown();
+
+// Remap the frame buffer write-combining, or write-back if enable is false.
+// Without PAT support the frame buffer stays write-back.
+Error SetFrameBufferWriteCombining(bool enable);
+
+// Build page tables for the UEFI memory map, the frame buffer and the local APIC,
+// then switch CR3 to them. The memory manager must be initialized beforehand.
+void InitializePaging(const MemoryMap& memory_map);
+
+// Give an application processor the same PAT and CR4 paging features as the
+// BSP. CR3 must already point to the kernel page tables.
+void InitializePagingAP();
@@ -1,6 +1,7 @@
 #include "pci.hpp"
 #include "asmfunc.h"
 #include "logger.hpp"
+#include "paging.hpp"
 
 uint32_t MakeAddress(uint8_t bus, uint8_t device, uint8_t function, uint8_t reg_addr) {
     auto shl = [](uint32_t x, unsigned int bits) {
@@ -282,6 +283,68 @@ namespace pci {
             MAKE_ERROR(Error::kSuccess)
         };
     }
+
+    WithError<uint64_t> ReadBarSize(Device& device, unsigned int bar_index) {
+        if(bar_index >= 6) {
+            return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
+        }
+
+        const auto addr = CalcBarAddress(bar_index);
+        const auto bar = ReadConfReg(device, addr);
+        const bool is_64bit = (bar & 4u) != 0;
+        if(is_64bit && bar_index >= 5) {
+            return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
+        }
+
+        // 全ビット1を書き込むと、サイズに応じた下位ビットが0で読み出される
+        // 書き込み中にデコードされないよう、I/O とメモリ空間を一時的に無効にする
+        const auto command = ReadConfReg(device, 0x04);
+        WriteConfReg(device, 0x04, command & ~0x3u);
+
+        WriteConfReg(device, addr, 0xffffffffu);
+        uint64_t mask = ReadConfReg(device, addr) & ~0xfu;
+        WriteConfReg(device, addr, bar);
+        if(is_64bit) {
+            const auto bar_upper = ReadConfReg(device, addr + 4);
+            WriteConfReg(device, addr + 4, 0xffffffffu);
+            mask |= static_cast<uint64_t>(ReadConfReg(device, addr + 4)) << 32;
+            WriteConfReg(device, addr + 4, bar_upper);
+        }
+        else {
+            mask |= 0xffffffff00000000u;
+        }
+
+        WriteConfReg(device, 0x04, command);
+        return {~mask + 1, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    // メモリ空間の BAR を恒等写像する（I/O 空間の BAR は対象外）
+    void MapMemoryBars(Device& device) {
+        const int num_bars = (device.header_type & 0x7fu) == 0 ? 6 : 2;
+        for(int i = 0; i < num_bars; i++) {
+            const auto bar = ReadConfReg(device, CalcBarAddress(i));
+            if(bar & 1u) {
+                continue;
+            }
+            const int bar_index = i;
+            auto [ base, base_err ] = ReadBar(device, bar_index);
+            auto [ size, size_err ] = ReadBarSize(device, bar_index);
+            if(bar & 4u) { // 64bit BAR は2つ分を使う
+                ++i;
+            }
+            base &= ~static_cast<uint64_t>(0xf);
+            if(base_err || size_err || base == 0 || size == 0) {
+                continue;
+            }
+
+            // prefetchable でなければキャッシュを無効にする
+            const uint64_t attr = (bar & 8u) ? kPageWritable : kPageWritable | kPageCacheDisable;
+            if(auto err = MapIdentity(base, size, attr)) {
+                Log(kError, "failed to map BAR%d of %d.%d.%d: %s\n",
+                    bar_index, device.bus, device.device, device.function, err.Name());
+            }
+        }
+    }
 }
 
 void InitializePCI() {
@@ -297,5 +360,6 @@ void InitializePCI() {
         Log(kDebug, "%d.%d.%d: vend %04x, class %08x, head %02x\n",
             dev.bus, dev.device, dev.function,
             vendor_id, class_code, dev.header_type);
+        pci::MapMemoryBars(pci::devices[i]);
     }
 }
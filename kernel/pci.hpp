@@ -101,6 +101,8 @@ namespace pci {
     Error ScanBus(uint8_t bus);
     Error ScanAllBus();
     WithError<uint64_t> ReadBar(Device& device, unsigned int bar_index);
+    WithError<uint64_t> ReadBarSize(Device& device, unsigned int bar_index);
+    void MapMemoryBars(Device& device);
     uint32_t ReadConfReg(const Device& dev, uint8_t reg_addr);
 
     MSICapability ReadMSICapability(const Device& dev, uint8_t cap_addr);
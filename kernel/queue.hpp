@@ -1,5 +1,10 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
 #include "error.hpp"
 
 template<typename T>
@@ -68,3 +73,86 @@ template <typename T>
 const T& ArrayQueue<T>::Front() const {
   return data_[read_pos_];
 }
+
+// 固定長のリングバッファ。複数の送り手（割り込みハンドラを含む）と 1 つの受け手が、
+// 割り込みを禁止せずに使える。
+// 要素ごとの通し番号で書き込みの完了を受け手に伝える（Vyukov の bounded queue）。
+// 書き込み途中の送り手がいると、それ以降の要素は書き込みが終わるまで受け取れない。
+template<typename T, size_t N>
+class MPSCQueue {
+    public:
+        static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of 2");
+
+        MPSCQueue();
+        MPSCQueue(const MPSCQueue&) = delete;
+        MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+        // 送り手側。満杯なら kFull を返す
+        Error Push(const T& value);
+        // 受け手側。空なら std::nullopt を返す
+        std::optional<T> Pop();
+        // 送り手が確保済みの要素も数えるので、目安としてだけ使う
+        size_t Count() const;
+        size_t Capacity() const { return N; }
+
+    private:
+        struct Cell {
+            std::atomic<size_t> seq;  // pos: 空き、pos + 1: 書き込み済み
+            T value;
+        };
+
+        std::array<Cell, N> cells_;
+        std::atomic<size_t> write_pos_{0};
+        size_t read_pos_{0};
+};
+
+template<typename T, size_t N>
+MPSCQueue<T, N>::MPSCQueue() {
+    for(size_t i = 0; i < N; ++i) {
+        cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+}
+
+template<typename T, size_t N>
+Error MPSCQueue<T, N>::Push(const T& value) {
+    size_t pos = write_pos_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while(true) {
+        cell = &cells_[pos & (N - 1)];
+        const size_t seq = cell->seq.load(std::memory_order_acquire);
+        const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if(diff == 0) {
+            if(write_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if(diff < 0) {  // 受け手がまだ 1 周前の要素を取り出していない
+            return MAKE_ERROR(Error::kFull);
+        }
+        else {
+            pos = write_pos_.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->value = value;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+template<typename T, size_t N>
+std::optional<T> MPSCQueue<T, N>::Pop() {
+    Cell& cell = cells_[read_pos_ & (N - 1)];
+    if(cell.seq.load(std::memory_order_acquire) != read_pos_ + 1) {
+        return std::nullopt;
+    }
+
+    T value = cell.value;
+    cell.seq.store(read_pos_ + N, std::memory_order_release);
+    ++read_pos_;
+    return value;
+}
+
+template<typename T, size_t N>
+size_t MPSCQueue<T, N>::Count() const {
+    return write_pos_.load(std::memory_order_relaxed) - read_pos_;
+}
@@ -1,8 +1,27 @@
 #include "segment.hpp"
 #include "asmfunc.h"
+#include "smp.hpp"
 
 namespace {
-    std::array<SegmentDescriptor, 3> gdt;
+    // TSS ディスクリプタは 16 バイトなので 5, 6 番の 2 つ分を使う
+    using GDT = std::array<SegmentDescriptor, 7>;
+
+    struct TaskStateSegment {
+        uint32_t reserved0;
+        uint64_t rsp[3];
+        uint64_t reserved1;
+        uint64_t ist[7];
+        uint64_t reserved2;
+        uint16_t reserved3;
+        uint16_t io_map_base;
+    } __attribute__((packed));
+    static_assert(sizeof(TaskStateSegment) == 104);
+
+    // TSS は CPU ごとに必要なので、GDT も CPU ごとに持つ
+    std::array<GDT, kMaxCPUs> gdts;
+    std::array<TaskStateSegment, kMaxCPUs> tsss;
+
+    alignas(16) uint8_t page_fault_stack[kISTStackBytes]; // BSP 用
 }
 
 
@@ -33,15 +52,42 @@ void SetDataSegment(SegmentDescriptor& desc, DescriptorType type,
 }
 
 
-void SetupSegments() {
+void SetSystemSegment(SegmentDescriptor& desc, DescriptorType type,
+                      unsigned int descriptor_privilege_level, uint64_t base, uint32_t limit) {
+    SetCodeSegment(desc, type, descriptor_privilege_level, base & 0xffffffffu, limit);
+    desc.bits.system_segment = 0;
+    desc.bits.long_mode = 0;
+    desc.bits.granularity = 0;
+    (&desc)[1].data = base >> 32;  // 上位 8 バイトにベースアドレスの上位 32 ビット
+}
+
+void SetupSegments(int cpu) {
+    auto& gdt = gdts[cpu];
     gdt[0].data = 0;
     SetCodeSegment(gdt[1], DescriptorType::kExecuteRead, 0, 0, 0xfffff);
     SetDataSegment(gdt[2], DescriptorType::kReadWrite, 0, 0, 0xfffff);
+    gdt[3].data = 0;
+    gdt[4].data = 0;
+    SetSystemSegment(gdt[kTSS >> 3], DescriptorType::kTSSAvailable, 0,
+                     reinterpret_cast<uint64_t>(&tsss[cpu]), sizeof(TaskStateSegment) - 1);
     LoadGDT(sizeof(gdt) - 1, reinterpret_cast<uintptr_t>(&gdt[0]));
 }
 
-void InitializeSegmentation() {
-    SetupSegments();
+void SetupTSS(int cpu, uint64_t page_fault_stack_end) {
+    auto& tss = tsss[cpu];
+    // ページフォールトはスタックの未確保ページでも起きるので、専用のスタックで処理する
+    tss.ist[kISTForPageFault - 1] = page_fault_stack_end;
+    tss.io_map_base = sizeof(tss);
+    LoadTR(kTSS);
+}
+
+void InitializeSegmentation(int cpu, uint64_t page_fault_stack_end) {
+    SetupSegments(cpu);
     SetDSAll(kKernelDS);
     SetCSSS(kKernelCS, kKernelSS);
-}
\ No newline at end of file
+    SetupTSS(cpu, page_fault_stack_end);
+}
+
+void InitializeSegmentation() {
+    InitializeSegmentation(0, reinterpret_cast<uint64_t>(page_fault_stack) + kISTStackBytes);
+}
@@ -23,7 +23,7 @@ union SegmentDescriptor {
     } __attribute__((packed)) bits;
 } __attribute__((packed));
 
-void SetupSegments();
+void SetupSegments(int cpu);
 
 void SetDataSegment(SegmentDescriptor& desc, DescriptorType type, 
   unsigned int descriptor_privilege_level, uint32_t base, uint32_t limit);
@@ -31,9 +31,19 @@ void SetDataSegment(SegmentDescriptor& desc, DescriptorType type,
 void SetCodeSegment(SegmentDescriptor& desc, DescriptorType type, 
   unsigned int descriptor_privilege_level, uint32_t base, uint32_t limit);
 
+// Set a 16-byte system segment descriptor (e.g. TSS) in desc and the entry after it.
+void SetSystemSegment(SegmentDescriptor& desc, DescriptorType type,
+  unsigned int descriptor_privilege_level, uint64_t base, uint32_t limit);
+
 const uint16_t kKernelCS = 1 << 3;  // セグメントセレクタの形式に変換
 const uint16_t kKernelSS = 2 << 3;
 const uint16_t kKernelDS = 0;
 const uint16_t kTSS = 5 << 3;
 
+// Interrupt Stack Table index used by the page fault handler
+const int kISTForPageFault = 1;
+const size_t kISTStackBytes = 4 * 4096;
+
+// Load the GDT and TSS of the CPU with the given index (0 is the BSP).
+void InitializeSegmentation(int cpu, uint64_t page_fault_stack_end);
 void InitializeSegmentation();
\ No newline at end of file
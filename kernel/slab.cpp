@@ -0,0 +1,228 @@
+#include <new>
+#include "slab.hpp"
+#include "logger.hpp"
+#include "spinlock.hpp"
+
+namespace {
+    const uint64_t kSlabMagic = 0x42414c53; // "SLAB"
+
+    size_t large_object_frames = 0;
+
+    // 全キャッシュで共有する。フレームの確保・解放は memory_manager のロックで守られる
+    SpinLock slab_lock;
+}
+
+struct SlabCache::SlabHeader {
+    uint64_t magic;
+    SlabCache* cache;   // nullptr if the frames hold one large object
+    size_t num_frames;
+    size_t in_use;
+    void* free_list;
+    SlabHeader* prev;
+    SlabHeader* next;
+};
+static_assert(sizeof(SlabCache::SlabHeader) <= SlabCache::kHeaderBytes);
+
+std::array<SlabCache, kNumSlabCaches> slab_caches{
+    SlabCache{16}, SlabCache{32}, SlabCache{48}, SlabCache{64},
+    SlabCache{96}, SlabCache{128}, SlabCache{192}, SlabCache{256},
+    SlabCache{512}, SlabCache{768}, SlabCache{1024},
+};
+
+SlabCache::SlabHeader* SlabCache::NewSlab() {
+    if(memory_manager == nullptr) {
+        return nullptr;
+    }
+    auto frame = memory_manager->Allocate(1);
+    if(frame.error) {
+        return nullptr;
+    }
+
+    auto slab = reinterpret_cast<SlabHeader*>(frame.value.Frame());
+    slab->magic = kSlabMagic;
+    slab->cache = this;
+    slab->num_frames = 1;
+    slab->in_use = 0;
+    slab->prev = nullptr;
+    slab->next = nullptr;
+
+    // 未使用オブジェクトを単方向リストにつなぐ
+    auto objects = reinterpret_cast<uint8_t*>(slab) + kHeaderBytes;
+    slab->free_list = nullptr;
+    for(size_t i = objects_per_slab_; i > 0; --i) {
+        auto obj = objects + (i - 1) * object_size_;
+        *reinterpret_cast<void**>(obj) = slab->free_list;
+        slab->free_list = obj;
+    }
+
+    ++slab_count_;
+    return slab;
+}
+
+void SlabCache::Unlink(SlabHeader* slab) {
+    if(slab->prev) {
+        slab->prev->next = slab->next;
+    }
+    else {
+        partial_ = slab->next;
+    }
+    if(slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev = slab->next = nullptr;
+}
+
+void* SlabCache::Alloc() {
+    if(partial_ == nullptr) {
+        partial_ = NewSlab();
+        if(partial_ == nullptr) {
+            return nullptr;
+        }
+    }
+
+    auto slab = partial_;
+    void* p = slab->free_list;
+    slab->free_list = *reinterpret_cast<void**>(p);
+    ++slab->in_use;
+    ++objects_in_use_;
+    if(slab->free_list == nullptr) { // full
+        Unlink(slab);
+    }
+    return p;
+}
+
+void SlabCache::Free(SlabHeader* slab, void* p) {
+    const bool was_full = slab->free_list == nullptr;
+    *reinterpret_cast<void**>(p) = slab->free_list;
+    slab->free_list = p;
+    --slab->in_use;
+    --objects_in_use_;
+
+    if(was_full) {
+        slab->next = partial_;
+        if(partial_) {
+            partial_->prev = slab;
+        }
+        partial_ = slab;
+    }
+
+    // 空になったスラブは、他に空きのあるスラブがあればフレームを返却する
+    if(slab->in_use == 0 && (slab->prev || slab->next)) {
+        Unlink(slab);
+        slab->magic = 0;
+        memory_manager->Free(FrameID{reinterpret_cast<uintptr_t>(slab) / kBytesPerFrame}, 1);
+        --slab_count_;
+    }
+}
+
+void* SlabAlloc(size_t bytes, size_t align) {
+    if(align > SlabCache::kHeaderBytes) {
+        return nullptr;
+    }
+
+    // operator new is called from interrupt handlers too (e.g. SendMessage)
+    SpinLockGuard guard{slab_lock};
+    if(bytes <= kMaxSlabObjectBytes) {
+        // オブジェクトは kHeaderBytes + i * ObjectSize() に並ぶので、
+        // サイズが align の倍数のキャッシュなら全オブジェクトが align にそろう
+        for(auto& cache : slab_caches) {
+            if(bytes <= cache.ObjectSize() && cache.ObjectSize() % align == 0) {
+                return cache.Alloc();
+            }
+        }
+    }
+
+    if(memory_manager == nullptr) {
+        return nullptr;
+    }
+    const size_t num_frames = (SlabCache::kHeaderBytes + bytes + kBytesPerFrame - 1) / kBytesPerFrame;
+    auto frame = memory_manager->Allocate(num_frames);
+    if(frame.error) {
+        return nullptr;
+    }
+    auto header = reinterpret_cast<SlabCache::SlabHeader*>(frame.value.Frame());
+    header->magic = kSlabMagic;
+    header->cache = nullptr;
+    header->num_frames = num_frames;
+    large_object_frames += num_frames;
+    return reinterpret_cast<uint8_t*>(header) + SlabCache::kHeaderBytes;
+}
+
+void SlabFree(void* p) {
+    if(p == nullptr) {
+        return;
+    }
+
+    SpinLockGuard guard{slab_lock};
+    auto header = reinterpret_cast<SlabCache::SlabHeader*>(
+        reinterpret_cast<uintptr_t>(p) & ~(kBytesPerFrame - 1));
+    if(header->magic != kSlabMagic) {
+        Log(kError, "SlabFree: %p is not a slab object\n", p);
+        return;
+    }
+
+    if(header->cache) {
+        header->cache->Free(header, p);
+        return;
+    }
+    header->magic = 0;
+    large_object_frames -= header->num_frames;
+    memory_manager->Free(FrameID{reinterpret_cast<uintptr_t>(header) / kBytesPerFrame},
+                         header->num_frames);
+}
+
+size_t LargeObjectFrames() {
+    return large_object_frames;
+}
+
+LockStats SlabLockContention() {
+    return slab_lock.Stats();
+}
+
+void* operator new(size_t bytes) {
+    return SlabAlloc(bytes);
+}
+
+void* operator new[](size_t bytes) {
+    return SlabAlloc(bytes);
+}
+
+void* operator new(size_t bytes, std::align_val_t align) {
+    return SlabAlloc(bytes, static_cast<size_t>(align));
+}
+
+void* operator new[](size_t bytes, std::align_val_t align) {
+    return SlabAlloc(bytes, static_cast<size_t>(align));
+}
+
+void operator delete(void* p) noexcept {
+    SlabFree(p);
+}
+
+void operator delete[](void* p) noexcept {
+    SlabFree(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    SlabFree(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    SlabFree(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+    SlabFree(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept {
+    SlabFree(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+    SlabFree(p);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+    SlabFree(p);
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include "memory_manager.hpp"
+#include "spinlock.hpp"
+
+// Cache of equally sized objects carved out of single-frame slabs.
+// Every slab starts with a header of kHeaderBytes, so the slab of an object is
+// found by rounding its address down to the frame boundary.
+class SlabCache {
+    public:
+        static const size_t kHeaderBytes = 64;
+        struct SlabHeader;
+
+        constexpr explicit SlabCache(size_t object_size)
+            : object_size_{object_size},
+              objects_per_slab_{(kBytesPerFrame - kHeaderBytes) / object_size} {}
+
+        void* Alloc();
+        void Free(SlabHeader* slab, void* p);
+        size_t ObjectSize() const { return object_size_; }
+        size_t SlabCount() const { return slab_count_; }
+        size_t ObjectsInUse() const { return objects_in_use_; }
+
+    private:
+        size_t object_size_;
+        size_t objects_per_slab_;
+        SlabHeader* partial_{nullptr}; // slabs which have at least one free object
+        size_t slab_count_{0};
+        size_t objects_in_use_{0};
+
+        SlabHeader* NewSlab();
+        void Unlink(SlabHeader* slab);
+};
+
+// 1024 バイトを超える要求はフレーム単位で確保する
+static const size_t kMaxSlabObjectBytes = 1024;
+static const int kNumSlabCaches = 11;
+extern std::array<SlabCache, kNumSlabCaches> slab_caches;
+
+// align は kHeaderBytes 以下の 2 のべき乗。大きいオブジェクトは常に kHeaderBytes にそろう
+void* SlabAlloc(size_t bytes, size_t align = 16);
+void SlabFree(void* p);
+
+// Number of frames held by objects larger than kMaxSlabObjectBytes.
+size_t LargeObjectFrames();
+
+LockStats SlabLockContention();
@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <cstring>
+#include "smp.hpp"
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "clock.hpp"
+#include "fpu.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "segment.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+namespace {
+    volatile uint32_t& local_apic_id = *reinterpret_cast<uint32_t*>(0xfee00020);
+    volatile uint32_t& spurious_vector = *reinterpret_cast<uint32_t*>(0xfee000f0);
+    volatile uint32_t& icr_low = *reinterpret_cast<uint32_t*>(0xfee00300);
+    volatile uint32_t& icr_high = *reinterpret_cast<uint32_t*>(0xfee00310);
+
+    const uint32_t kIPIInit = 0x4500;    // INIT, assert
+    const uint32_t kIPIStartup = 0x4600; // 下位 8 ビットは起動コードのページ番号
+    const uint32_t kIPIFixed = 0x4000;   // 下位 8 ビットは割り込みベクタ
+    const uint32_t kIPIToSelf = 0x40000; // 宛先の省略形: 自分
+    const uint32_t kIA32EFER = 0xc0000080;
+    const uint64_t kEFERLMA = 1u << 10;  // 読み出し専用
+    const uint64_t kCR4PCIDE = 1u << 17;
+    const uint64_t kCR0TS = 1u << 3;
+
+    const size_t kAPStackBytes = 16 * 4096;
+
+    // asmfunc.asm の APTrampolineParams と同じ並び
+    struct APBootParams {
+        uint64_t cr0, cr3, cr4, efer;
+        uint64_t stack, entry, arg;
+    };
+
+    // APIC ID から CPU のインデックスを引く。未登録の ID は BSP になる
+    std::array<uint8_t, 256> cpu_index_of{};
+    std::array<uint64_t, kMaxCPUs> page_fault_stack_ends;
+
+    void WriteICR(uint8_t apic_id, uint32_t command) {
+        icr_high = static_cast<uint32_t>(apic_id) << 24;
+        icr_low = command;
+        while(icr_low & (1u << 12)); // 送信が終わるまで待つ
+    }
+
+    // 1 MiB 未満はフレームとして配られないので、空き領域のページをそのまま使える
+    uintptr_t FindTrampolinePage(const MemoryMap& memory_map) {
+        const auto base = reinterpret_cast<uintptr_t>(memory_map.buffer);
+        for(uintptr_t iter = base; iter < base + memory_map.map_size;
+            iter += memory_map.descriptor_size) {
+            auto desc = reinterpret_cast<const MemoryDescriptor*>(iter);
+            if(!IsAvailable(static_cast<MemoryType>(desc->type))) {
+                continue;
+            }
+            const uintptr_t begin = std::max<uintptr_t>(desc->physical_start, kBytesPerFrame);
+            const uintptr_t end = desc->physical_start + desc->number_of_pages * kUEFIPageSize;
+            if(begin + kBytesPerFrame <= std::min<uintptr_t>(end, kLowMemoryEnd)) {
+                return begin;
+            }
+        }
+        return 0;
+    }
+
+    APBootParams& BootParams(uintptr_t trampoline) {
+        return *reinterpret_cast<APBootParams*>(trampoline + (APTrampolineParams - APTrampoline));
+    }
+
+    // 起動コードから 64 ビットモードで呼ばれる
+    void APMain(uint64_t cpu) {
+        InitializeClockAP(cpu); // BSP は SyncClockWithAP で待っている
+        InitializeSegmentation(cpu, page_fault_stack_ends[cpu]);
+        LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
+        InitializePagingAP();
+        InitializeFPU();
+        __asm__("fninit");
+
+        spurious_vector = 0x100 | InterruptVector::kSpurious; // INIT で無効になっている Local APIC を有効にする
+        StartLAPICTimerInterrupt();
+
+        // ここからはこの CPU の idle タスクとして動く
+        cpus[cpu].online.store(true, std::memory_order_release);
+        __asm__("sti");
+        while(true) __asm__("hlt");
+    }
+
+    bool StartAP(int cpu, uintptr_t trampoline) {
+        // AP はメモリを確保しないで済むように、スタックは BSP が用意する
+        auto stack = new uint8_t[kAPStackBytes];
+        auto page_fault_stack = new uint8_t[kISTStackBytes];
+        if(stack == nullptr || page_fault_stack == nullptr) {
+            delete[] stack;
+            delete[] page_fault_stack;
+            return false;
+        }
+        page_fault_stack_ends[cpu] = reinterpret_cast<uint64_t>(page_fault_stack) + kISTStackBytes;
+
+        auto& params = BootParams(trampoline);
+        params.stack = reinterpret_cast<uint64_t>(stack) + kAPStackBytes;
+        params.entry = reinterpret_cast<uint64_t>(APMain);
+        params.arg = cpu;
+
+        const uint8_t apic_id = cpus[cpu].apic_id;
+        auto online = [cpu]() { return cpus[cpu].online.load(std::memory_order_acquire); };
+        WriteICR(apic_id, kIPIInit);
+        acpi::WaitMillseconds(10);
+        for(int i = 0; i < 2 && !online(); ++i) {
+            WriteICR(apic_id, kIPIStartup | (trampoline >> 12));
+            acpi::WaitMillseconds(1);
+        }
+        if(!SyncClockWithAP(cpu)) {
+            Log(kWarn, "CPU %d did not synchronize its TSC\n", cpu);
+        }
+        for(int msec = 0; msec < 100 && !online(); ++msec) {
+            acpi::WaitMillseconds(1);
+        }
+
+        if(!online()) {
+            // 後から動き出して次の AP とスタックを共有しないよう、INIT で止めておく
+            // スタックは使われているかもしれないので解放しない
+            WriteICR(apic_id, kIPIInit);
+            return false;
+        }
+        return true;
+    }
+}
+
+std::array<CPU, kMaxCPUs> cpus;
+int num_cpus = 1;
+
+uint8_t LocalAPICID() {
+    return local_apic_id >> 24;
+}
+
+int CurrentCPU() {
+    return cpu_index_of[LocalAPICID()];
+}
+
+void SendIPI(int cpu, uint8_t vector) {
+    // ICR の上位と下位の書き込みの間に、割り込みハンドラが別の IPI を送らないように
+    InterruptGuard guard;
+    WriteICR(cpus[cpu].apic_id, kIPIFixed | vector);
+}
+
+void SendSelfIPI(uint8_t vector) {
+    InterruptGuard guard;
+    WriteICR(0, kIPIToSelf | kIPIFixed | vector);
+}
+
+void InitializeSMP(const MemoryMap& memory_map) {
+    cpus[0].apic_id = LocalAPICID();
+    cpus[0].online = true;
+    if(acpi::madt == nullptr) {
+        return;
+    }
+
+    const uintptr_t trampoline = FindTrampolinePage(memory_map);
+    if(trampoline == 0) {
+        Log(kWarn, "no free page below 1 MiB: APs are not started\n");
+        return;
+    }
+    // 起動コードは 32 ビットモードで CR3 を設定する
+    if(KernelCR3() >> 32) {
+        Log(kWarn, "kernel page table above 4 GiB: APs are not started\n");
+        return;
+    }
+    if(auto err = MapIdentity(trampoline, kBytesPerFrame)) {
+        Log(kError, "failed to map AP trampoline: %s at %s:%d\n",
+            err.Name(), err.File(), err.Line());
+        return;
+    }
+
+    memcpy(reinterpret_cast<void*>(trampoline), APTrampoline, APTrampolineEnd - APTrampoline);
+    auto& params = BootParams(trampoline);
+    params.cr0 = GetCR0() & ~kCR0TS; // 起動処理の fninit で #NM にならないように
+    params.cr3 = KernelCR3();
+    params.cr4 = GetCR4() & ~kCR4PCIDE; // PCIDE は 64 ビットモードに入ってから立てる
+    params.efer = ReadMSR(kIA32EFER) & ~kEFERLMA;
+
+    const auto entries_begin = reinterpret_cast<const uint8_t*>(acpi::madt + 1);
+    const auto entries_end = reinterpret_cast<const uint8_t*>(acpi::madt) + acpi::madt->header.length;
+    for(auto p = entries_begin; p + 2 <= entries_end && p[1] >= 2; p += p[1]) {
+        if(p[0] != acpi::kMADTLocalAPIC) {
+            continue;
+        }
+        const auto& lapic = *reinterpret_cast<const acpi::MADTLocalAPIC*>(p);
+        if((lapic.flags & 1) == 0 || lapic.apic_id == cpus[0].apic_id) {
+            continue;
+        }
+        if(num_cpus == kMaxCPUs) {
+            Log(kWarn, "more than %d CPUs: the rest are not started\n", kMaxCPUs);
+            break;
+        }
+
+        const int cpu = num_cpus;
+        cpus[cpu].apic_id = lapic.apic_id;
+        cpu_index_of[lapic.apic_id] = cpu;
+        task_manager->InitializeCPU(cpu);
+        if(StartAP(cpu, trampoline)) {
+            ++num_cpus;
+        }
+        else {
+            Log(kWarn, "failed to start the CPU with APIC ID %u\n", lapic.apic_id);
+            cpu_index_of[lapic.apic_id] = 0;
+        }
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include "memory_map.hpp"
+
+const int kMaxCPUs = 64;
+
+// CPU ごとの情報。インデックス 0 が BSP で、AP は起動した順に並ぶ
+struct CPU {
+    uint8_t apic_id;
+    std::atomic<bool> online;
+    volatile unsigned long ticks; // Local APIC タイマ割り込みの回数
+    uint64_t slice_end; // tickless のとき、実行中のタスクを時間切れにする TSC の値。0 ならなし
+};
+
+extern std::array<CPU, kMaxCPUs> cpus;
+extern int num_cpus; // 起動済みの CPU の数
+
+uint8_t LocalAPICID();
+// 実行中の CPU のインデックス
+int CurrentCPU();
+
+// CPU に指定したベクタの割り込みを送る
+void SendIPI(int cpu, uint8_t vector);
+// 自分の CPU に割り込みを送る。割り込み禁止中なら、許可したところで受け取る
+void SendSelfIPI(uint8_t vector);
+
+// MADT に載っている AP を INIT-SIPI-SIPI で起動する
+// acpi::Initialize、InitializeLAPICTimer と InitializeTask の後、BSP で呼ぶ
+void InitializeSMP(const MemoryMap& memory_map);
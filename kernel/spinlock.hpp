@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include "interrupt.hpp"
+
+// ロックの競合の統計。値はロックを持っている間に更新する
+struct LockStats {
+    uint64_t acquisitions; // 取得した回数
+    uint64_t contentions;  // すぐには取れなかった回数
+    uint64_t waits;        // 待った量（スピンロックは pause の回数、Mutex は Sleep の回数）
+};
+
+// CPU 間で共有するデータを守るチケットロック。取れるのは到着した順。
+// 割り込みハンドラとも共有するデータでは、割り込みを禁止してから取ること（SpinLockGuard）。
+class SpinLock {
+    public:
+        void Lock() {
+            const uint32_t ticket = next_.fetch_add(1, std::memory_order_relaxed);
+            uint64_t spins = 0;
+            while(serving_.load(std::memory_order_acquire) != ticket) {
+                __builtin_ia32_pause();
+                ++spins;
+            }
+            ++acquisitions_;
+            if(spins > 0) {
+                ++contentions_;
+                waits_ += spins;
+            }
+        }
+        bool TryLock() {
+            uint32_t ticket = serving_.load(std::memory_order_acquire);
+            if(!next_.compare_exchange_strong(ticket, ticket + 1,
+                                              std::memory_order_acquire, std::memory_order_relaxed)) {
+                return false;
+            }
+            ++acquisitions_;
+            return true;
+        }
+        void Unlock() {
+            serving_.store(serving_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+        LockStats Stats() const { return {acquisitions_, contentions_, waits_}; }
+    private:
+        std::atomic<uint32_t> next_{0};
+        std::atomic<uint32_t> serving_{0};
+        uint64_t acquisitions_{0};
+        uint64_t contentions_{0};
+        uint64_t waits_{0};
+};
+
+// 割り込みを禁止してからロックを取り、スコープを抜けると割り込みフラグを元の状態に戻す
+class SpinLockGuard {
+    public:
+        explicit SpinLockGuard(SpinLock& lock) : lock_{lock} {
+            lock_.Lock();
+        }
+        ~SpinLockGuard() {
+            lock_.Unlock();
+        }
+    private:
+        InterruptGuard interrupt_guard_; // lock_ より先に構築され、後に破棄される
+        SpinLock& lock_;
+};
+
+// 割り込みの状態には触らない。Mutex や、割り込みハンドラと共有しないデータ用
+template<typename L>
+class LockGuard {
+    public:
+        explicit LockGuard(L& lock) : lock_{lock} {
+            lock_.Lock();
+        }
+        ~LockGuard() {
+            lock_.Unlock();
+        }
+    private:
+        L& lock_;
+};
@@ -1,46 +1,77 @@
 #include <cstring>
-#include <algorithm>
+#include <cstdlib>
 #include "task.hpp"
 #include "timer.hpp"
 #include "segment.hpp"
 #include "asmfunc.h"
+#include "paging.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
 
 namespace {
-    template<class T, class U>
-    void Erase(T& c, const U& value) {
-        auto it = std::remove(c.begin(), c.end(), value);
-        c.erase(it, c.end());
-    }
-
     void TaskIdle(uint64_t task_id, int64_t data) {
         while (true) __asm__("hlt");
     }
+
+    // 割り込み禁止で始まり、切り替え元が取ったロックを外してから許可する。
+    // タスク関数から戻ったらそのタスクを終了する
+    void TaskEntry(uint64_t task_id, int64_t data, TaskFunc* f) {
+        task_manager->FinishSwitch();
+        __asm__("sti");
+        f(task_id, data);
+        task_manager->Finish();
+    }
 }
 
-alignas(16) TaskContext task_a_ctx, task_b_ctx;
+Task::Task(uint64_t id) : id_{ id }, cpu_{ CurrentCPU() } {
+    memset(&context_, 0, sizeof(context_));
+    context_.cr3 = KernelCR3();
+}
 
-Task::Task(uint64_t id) : id_{ id } {
+Task::~Task() {
+    FreeTaskStack(stack_);
+    FreeAddressSpace(context_.cr3);
 }
 
-Task& Task::InitContext(TaskFunc* f, int64_t data) {
-    const size_t stack_size = kDefaultStackBytes / sizeof(stack_[0]);
-    stack_.resize(stack_size);
-    uint64_t stack_end = reinterpret_cast<uint64_t>(&stack_[stack_size]);
+Task& Task::InitContext(TaskFunc* f, int64_t data, size_t stack_bytes) {
+    stack_bytes = (stack_bytes + 4095) & ~static_cast<size_t>(4095);
+    if (stack_.bytes != stack_bytes) {
+        FreeTaskStack(stack_);
+        auto [ stack, err ] = AllocateTaskStack(stack_bytes);
+        if (err) {
+            Log(kError, "InitContext: failed to allocate a stack: %s at %s:%d\n",
+                err.Name(), err.File(), err.Line());
+            exit(1);
+        }
+        stack_ = stack;
+    }
+    const uint64_t stack_end = stack_.End();
 
+    const uint64_t cr3 = context_.cr3;
     memset(&context_, 0, sizeof(context_));
-    context_.cr3 = GetCR3();
-    context_.rflags = 0x202;
+    context_.cr3 = cr3;
+    context_.rflags = 0x002; // IF は TaskEntry で立てる
     context_.cs = kKernelCS;
     context_.ss = kKernelSS;
-    context_.rsp = (stack_end & ~0xflu);
-    context_.rip = reinterpret_cast<uint64_t>(f);
+    context_.rsp = (stack_end & ~0xflu) - 8; // call 直後と同じく rsp + 8 が 16 バイト境界
+    context_.rip = reinterpret_cast<uint64_t>(TaskEntry);
     context_.rdi = id_;
     context_.rsi = data;
-
-    *reinterpret_cast<uint32_t*>(&task_b_ctx.fxsave_area[24]) = 0x1f80;
+    context_.rdx = reinterpret_cast<uint64_t>(f);
+    InitializeFPUArea(context_.fpu_area.data());
     return *this;
 }
 
+Error Task::CreateAddressSpace() {
+    auto [ cr3, err ] = NewAddressSpace();
+    if (err) {
+        return err;
+    }
+    FreeAddressSpace(context_.cr3);
+    context_.cr3 = cr3;
+    return MAKE_ERROR(Error::kSuccess);
+}
+
 TaskContext& Task::Context() {
     return context_;
 }
@@ -59,91 +90,394 @@ Task& Task::Wakeup() {
     return *this;
 }
 
-void Task::SendMessage(const Message& msg) {
-    msgs_.push_back(msg);
-    Wakeup();
+void Task::PostMessage(const Message& msg) {
+    const uint32_t type_bit = 1u << msg.type;
+    const bool coalesce = coalesced_types_ & type_bit;
+    if (coalesce && (pending_types_.fetch_or(type_bit) & type_bit)) {
+        coalesced_messages_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    if (msgs_.Push(msg)) {
+        if (coalesce) {
+            pending_types_.fetch_and(~type_bit);
+        }
+        dropped_messages_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void Task::NotifyMessages() {
+    msg_waiters_.WakeAll();
 }
 
 std::optional<Message> Task::ReceiveMessage() {
-    if (msgs_.empty()) {
-        return std::nullopt;
+    auto m = msgs_.Pop();
+    if (m && (coalesced_types_ & (1u << m->type))) {
+        // 取り出した後に届いたものは改めて積む
+        pending_types_.fetch_and(~(1u << m->type));
     }
-
-    auto m = msgs_.front();
-    msgs_.pop_front();
     return m;
 }
 
+std::optional<Message> Task::WaitMessage(unsigned long timeout) {
+    std::optional<Message> msg;
+    auto received = [this, &msg]() {
+        msg = ReceiveMessage();
+        return msg.has_value();
+    };
+
+    if (timeout == kWaitForever) {
+        msg_waiters_.Wait(received);
+    }
+    else {
+        msg_waiters_.WaitUntil(received, timer_manager->CurrentTick() + timeout);
+    }
+    return msg;
+}
+
+size_t Task::ReceiveMessages(Message* msgs, size_t len) {
+    size_t count = 0;
+    while (count < len) {
+        auto m = ReceiveMessage();
+        if (!m) {
+            break;
+        }
+        msgs[count++] = *m;
+    }
+    return count;
+}
+
+Task& Task::CoalesceMessages(Message::Type type) {
+    coalesced_types_ |= 1u << type;
+    return *this;
+}
+
+Task& Task::Pin() {
+    pinned_ = true;
+    return *this;
+}
+
 TaskManager* task_manager;
 
 TaskManager::TaskManager() {
+    for (int i = 0; i < kMaxCPUs; ++i) {
+        cpus_[i].cpu = i;
+    }
+
+    // xHCI の割り込みは BSP に届くので、その処理をするメインタスクも BSP から動かさない
+    auto& q = cpus_[0];
+    // 実行中のコンテキストの FPU 状態は、最初の切り替えで保存される
     Task& task = NewTask()
-        .SetLevel(current_level_)
-        .SetRunning(true);
-    running_[current_level_].push_back(&task);
+        .SetLevel(kMaxLevel)
+        .SetRunning(true)
+        .Pin();
+    PushRunning(q, &task);
+    q.current = &task;
+
+    Task& idle = NewTask().InitContext(TaskIdle, 0).SetLevel(0).SetRunning(true).Pin();
+    PushRunning(q, &idle);
+    q.idle = &idle;
+}
+
+void TaskManager::InitializeCPU(int cpu) {
+    auto& q = cpus_[cpu];
+    if (q.idle) {
+        return; // 起動に失敗した AP のものを使い回す
+    }
 
-    Task& idle = NewTask().InitContext(TaskIdle, 0).SetLevel(0).SetRunning(true);
-    running_[0].push_back(&idle);
+    Task& idle = NewTask().SetLevel(0).SetRunning(true).Pin();
+    idle.cpu_ = cpu;
+    InitializeFPUArea(idle.context_.fpu_area.data()); // AP は TS を落として起動するが念のため
+    PushRunning(q, &idle);
+    q.current = q.idle = &idle;
 }
 
 Task& TaskManager::NewTask() {
-    ++latest_id_;
-    return *tasks_.emplace_back(new Task{ latest_id_ });
+    ReapFinishedTasks();
+
+    SpinLockGuard guard{ slots_lock_ };
+    uint32_t slot = free_slot_;
+    if (slot != 0) {
+        free_slot_ = slots_[slot].next_free;
+    }
+    else if (unused_slot_ < kMaxTasks) {
+        slot = unused_slot_++;
+    }
+    else {
+        Log(kError, "NewTask: no free task slot (max %lu)\n", kMaxTasks - 1);
+        exit(1);
+    }
+
+    auto& s = slots_[slot];
+    s.task.reset(new Task{ (s.generation << kTaskSlotBits) | slot });
+    return *s.task;
 }
 
-void TaskManager::SwitchTask(bool current_sleep) {
-    auto& level_queue = running_[current_level_];
-    Task* current_task = level_queue.front();
-    level_queue.pop_front();
-    if (!current_sleep) {
-        level_queue.push_back(current_task);
+void TaskManager::Finish() {
+    __asm__("cli");
+    auto& q = ThisCPU();
+    Task* current_task = q.current;
+
+    // 自分のスタック上で実行中なので、解放は次の NewTask か Finish(id) まで遅らせる。
+    // スロットは先に外す（slots_lock_ は実行待ちリストのロックより先に取る）
+    {
+        SpinLockGuard guard{ slots_lock_ };
+        ReleaseSlot(current_task->ID()).release();
     }
-    if (level_queue.empty()) {
-        level_changed_ = true;
+    q.lock.Lock();
+    current_task->SetRunning(false);
+    current_task->finished_next_ = q.finished;
+    q.finished = current_task;
+    SwitchTaskLocked(q);
+
+    while (true) __asm__("hlt"); // 終了したタスクに戻ってくることはない
+}
+
+Error TaskManager::Finish(uint64_t id) {
+    if (id == CurrentTask().ID()) {
+        Finish();
     }
 
-    if (level_changed_) {
-        level_changed_ = false;
-        for (int lv = kMaxLevel; lv >= 0; --lv) {
-            if (!running_[lv].empty()) {
-                current_level_ = lv;
+    // 先にスロットを外し、以後 ID から引けないようにする。WithTask の途中のものはロックで待つ
+    std::unique_ptr<Task> finished;
+    {
+        SpinLockGuard guard{ slots_lock_ };
+        if (FindTaskLocked(id) == nullptr) {
+            return MAKE_ERROR(Error::kNoSuchTask);
+        }
+        finished = ReleaseSlot(id);
+    }
+    Task* task = finished.get();
+
+    {
+        InterruptGuard guard;
+        bool notified = false;
+        while (true) {
+            auto& q = LockQueueOf(task);
+            if (task != q.current) {
+                if (task->Running()) {
+                    RemoveRunning(q, task);
+                }
+                task->SetRunning(false);
+                q.lock.Unlock();
                 break;
             }
+
+            // 他の CPU で実行中なので、切り替わるのを待つ
+            task->SetRunning(false);
+            const int cpu = q.cpu;
+            q.lock.Unlock();
+            if (!notified) {
+                SendIPI(cpu, InterruptVector::kReschedule);
+                notified = true;
+            }
+            __builtin_ia32_pause();
+        }
+    }
+
+    ReapFinishedTasks();
+    return MAKE_ERROR(Error::kSuccess); // finished はロックの外で破棄される
+}
+
+// slots_lock_ を取った状態で呼ぶ
+Task* TaskManager::FindTaskLocked(uint64_t id) {
+    const auto& s = slots_[id & (kMaxTasks - 1)];
+    if (!s.task || s.generation != (id >> kTaskSlotBits)) {
+        return nullptr;
+    }
+    return s.task.get();
+}
+
+size_t TaskManager::StackUsages(StackUsage* usages, size_t len) {
+    SpinLockGuard guard{ slots_lock_ };
+    size_t n = 0;
+    for (uint32_t slot = 1; slot < unused_slot_ && n < len; ++slot) {
+        const auto& task = slots_[slot].task;
+        if (task && task->Stack().bytes > 0) {
+            usages[n++] = { task->ID(), task->Stack().bytes, task->Stack().HighWaterMark() };
+        }
+    }
+    return n;
+}
+
+// slots_lock_ を取った状態で呼ぶ
+std::unique_ptr<Task> TaskManager::ReleaseSlot(uint64_t id) {
+    const uint32_t slot = id & (kMaxTasks - 1);
+    auto& s = slots_[slot];
+    auto task = std::move(s.task);
+    ++s.generation;
+    s.next_free = free_slot_;
+    free_slot_ = slot;
+    return task;
+}
+
+void TaskManager::ReapFinishedTasks() {
+    for (int i = 0; i < num_cpus; ++i) {
+        // ロックが取れたなら、そのタスクからの切り替えは終わっている
+        Task* task;
+        {
+            SpinLockGuard guard{ cpus_[i].lock };
+            task = cpus_[i].finished;
+            cpus_[i].finished = nullptr;
+        }
+        while (task) {
+            Task* next = task->finished_next_;
+            delete task;
+            task = next;
+        }
+    }
+}
+
+void TaskManager::SwitchTask() {
+    InterruptGuard guard;
+    auto& q = ThisCPU();
+    q.lock.Lock();
+    SwitchTaskLocked(q);
+}
+
+// q.lock を取った状態で呼ぶ。戻るときにはロックは外れている
+void TaskManager::SwitchTaskLocked(CPUQueue& q) {
+    Task* current_task = q.current;
+    RemoveRunning(q, current_task);
+    if (current_task->Running()) {
+        PushRunning(q, current_task);
+    }
+
+    // 空でない最上位のレベルの先頭が次のタスク（idle があるので必ず見つかる）
+    Task* next_task = q.running[HighestRunningLevel(q)].head;
+    if (next_task == q.idle) {
+        if (Task* stolen = Steal(q)) {
+            next_task = stolen;
         }
     }
 
-    Task* next_task = running_[current_level_].front();
+    const uint64_t cpu_bit = static_cast<uint64_t>(1) << q.cpu;
+    if (next_task == q.idle) {
+        idle_cpus_.fetch_or(cpu_bit, std::memory_order_relaxed);
+    }
+    else {
+        idle_cpus_.fetch_and(~cpu_bit, std::memory_order_relaxed);
+    }
+
+    StartTimeSlice(next_task != q.idle);
+
+    if (next_task == current_task) {
+        q.lock.Unlock();
+        return;
+    }
+    q.current = next_task;
     SwitchContext(&next_task->Context(), &current_task->Context());
+    // 他の CPU に盗まれていれば、ここに戻ってくるのはその CPU
+    FinishSwitch();
+}
+
+void TaskManager::FinishSwitch() {
+    ThisCPU().lock.Unlock();
+}
+
+// 割り込みを禁止してから呼ぶ。返したリストにタスクがいる間はロックを持っている
+TaskManager::CPUQueue& TaskManager::LockQueueOf(Task* task) {
+    while (true) {
+        auto& q = cpus_[task->cpu_.load(std::memory_order_relaxed)];
+        q.lock.Lock();
+        if (q.cpu == task->cpu_.load(std::memory_order_relaxed)) {
+            return q;
+        }
+        q.lock.Unlock(); // ロックを待つ間に盗まれた
+    }
+}
+
+// 他の CPU のリストから、実行中のものを除いて最も優先度の高いタスクを 1 つ移す。
+// 自分のロックを持ったまま相手のロックを取るので、デッドロックしないよう TryLock で取る。
+Task* TaskManager::Steal(CPUQueue& q) {
+    if (q.cpu >= stealing_cpus_) {
+        return nullptr;
+    }
+
+    for (int i = 1; i < num_cpus; ++i) {
+        auto& victim = cpus_[(q.cpu + i) % num_cpus];
+        if (victim.num_unpinned.load(std::memory_order_relaxed) == 0 || !victim.lock.TryLock()) {
+            continue;
+        }
+
+        Task* task = nullptr;
+        for (uint64_t levels = victim.running_levels; levels != 0 && task == nullptr; ) {
+            const int level = 63 - __builtin_clzll(levels);
+            for (Task* t = victim.running[level].head; t != nullptr; t = t->run_next_) {
+                if (!t->pinned_ && t != victim.current) {
+                    task = t;
+                    break;
+                }
+            }
+            levels &= ~(static_cast<uint64_t>(1) << level);
+        }
+        if (task) {
+            RemoveRunning(victim, task);
+            task->cpu_.store(q.cpu, std::memory_order_relaxed);
+        }
+        victim.lock.Unlock();
+
+        if (task) {
+            PushRunning(q, task);
+            stolen_tasks_.fetch_add(1, std::memory_order_relaxed);
+            return task;
+        }
+    }
+    return nullptr;
 }
 
 void TaskManager::Sleep(Task* task) {
+    InterruptGuard guard;
+    auto& q = LockQueueOf(task);
+    const bool sleep_self = task == q.current && &q == &ThisCPU();
+    if (sleep_self && task->wakeup_pending_) {
+        // 受信を確かめてから Sleep するまでの間に、他の CPU から起こされていた
+        task->wakeup_pending_ = false;
+        q.lock.Unlock();
+        return;
+    }
     if (!task->Running()) {
+        q.lock.Unlock();
         return;
     }
 
     task->SetRunning(false);
 
-    if (task == running_[current_level_].front()) {
-        SwitchTask(true);
+    if (sleep_self) {
+        SwitchTaskLocked(q);
+        return;
+    }
+    if (task == q.current) {
+        // 他の CPU で実行中。その CPU が次に切り替えるときにリストから外れる
+        const int cpu = q.cpu;
+        q.lock.Unlock();
+        SendIPI(cpu, InterruptVector::kReschedule);
         return;
     }
 
-    Erase(running_[task->Level()], task);
+    RemoveRunning(q, task);
+    q.lock.Unlock();
 }
 
 Error TaskManager::Sleep(uint64_t id) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto& t) { return t->ID() == id; });
-    if (it == tasks_.end()) {
-        return MAKE_ERROR(Error::kNoSuchTask);
+    // 自分を眠らせるときはタスクを切り替えるので、slots_lock_ を持ったままにできない。
+    // 実行中のタスクは、他の CPU が Finish(id) しても切り替わるまで破棄されない
+    Task& current = CurrentTask();
+    if (id == current.ID()) {
+        Sleep(&current);
+        return MAKE_ERROR(Error::kSuccess);
     }
-
-    Sleep(it->get());
-    return MAKE_ERROR(Error::kSuccess);
+    return WithTask(id, [this](Task& task) { Sleep(&task); });
 }
 
 void TaskManager::Wakeup(Task* task, int level) {
+    // 割り込みハンドラの SendMessage からも呼ばれる
+    InterruptGuard guard;
+    auto& q = LockQueueOf(task);
     if (task->Running()) {
-        ChangeLevelRunning(task, level);
+        task->wakeup_pending_ = true;
+        ChangeLevelRunning(q, task, level);
+        q.lock.Unlock();
         return;
     }
 
@@ -151,73 +485,127 @@ void TaskManager::Wakeup(Task* task, int level) {
         level = task->Level();
     }
 
+    if (task == q.current) {
+        // 他の CPU で Sleep したが、まだ切り替わっていないのでリストに残っている
+        ChangeLevelRunning(q, task, level);
+        task->SetRunning(true);
+        q.lock.Unlock();
+        return;
+    }
+
     task->SetLevel(level);
     task->SetRunning(true);
-
-    running_[level].push_back(task);
-    if (level > current_level_) {
-        level_changed_ = true;
+    PushRunning(q, task);
+    const int cpu = q.cpu;
+    const bool pinned = task->pinned_;
+    q.lock.Unlock();
+
+    // 置いた CPU が忙しく、タスクを移せるなら、暇な CPU に盗みに来させる
+    const int this_cpu = CurrentCPU();
+    const uint64_t idle = idle_cpus_.load(std::memory_order_relaxed);
+    int target = cpu;
+    if (!pinned && (idle & (static_cast<uint64_t>(1) << cpu)) == 0) {
+        const uint64_t stealing = stealing_cpus_ >= 64 ?
+            ~static_cast<uint64_t>(0) : (static_cast<uint64_t>(1) << stealing_cpus_) - 1;
+        const uint64_t thieves = idle & stealing & ~(static_cast<uint64_t>(1) << this_cpu);
+        if (thieves) {
+            target = __builtin_ctzll(thieves);
+        }
+    }
+    if (target != this_cpu) {
+        SendIPI(target, InterruptVector::kReschedule);
+    }
+    else if (idle & (static_cast<uint64_t>(1) << this_cpu)) {
+        // 割り込みハンドラが idle タスクの上で起こした。tickless では idle に時間切れがないので、
+        // ハンドラから戻ったところで切り替えさせないと、次に何か起きるまで走らない
+        SendSelfIPI(InterruptVector::kReschedule);
     }
-    return;
 }
 
 Error TaskManager::Wakeup(uint64_t id, int level) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto& t) { return t->ID() == id; });
-    if (it == tasks_.end()) {
-        return MAKE_ERROR(Error::kNoSuchTask);
-    }
-
-    Wakeup(it->get(), level);
-    return MAKE_ERROR(Error::kSuccess);
+    return WithTask(id, [this, level](Task& task) { Wakeup(&task, level); });
 }
 
 Task& TaskManager::CurrentTask() {
-    return *running_[current_level_].front();
+    InterruptGuard guard; // 読んでいる間に他の CPU へ移されないように
+    return *ThisCPU().current;
 }
 
-Error TaskManager::SendMessage(uint64_t id, const Message& msg) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto& t) { return t->ID() == id; });
-
-    if (it == tasks_.end()) {
-        return MAKE_ERROR(Error::kNoSuchTask);
+LockStats TaskManager::RunQueueLockContention() const {
+    LockStats total{};
+    for (int i = 0; i < num_cpus; ++i) {
+        const auto stats = cpus_[i].lock.Stats();
+        total.acquisitions += stats.acquisitions;
+        total.contentions += stats.contentions;
+        total.waits += stats.waits;
     }
-    (*it)->SendMessage(msg);
+    return total;
+}
 
-    return MAKE_ERROR(Error::kSuccess);
+Error TaskManager::SendMessage(uint64_t id, const Message& msg) {
+    return WithTask(id, [&msg](Task& task) { task.SendMessage(msg); });
 }
 
-void TaskManager::ChangeLevelRunning(Task* task, int level) {
+void TaskManager::ChangeLevelRunning(CPUQueue& q, Task* task, int level) {
     if (level < 0 || level == task->Level()) {
         return;
     }
 
-    if (task != running_[current_level_].front()) {
-        Erase(running_[task->Level()], task);
-        running_[level].push_back(task);
-        task->SetLevel(level);
-        if (level > current_level_) {
-            level_changed_ = true;
-        }
-        return;
+    // 実行中のタスクは新しいレベルでも先頭に置き、次の切り替えまで実行を続ける
+    RemoveRunning(q, task);
+    task->SetLevel(level);
+    PushRunning(q, task, task == q.current);
+}
+
+void TaskManager::PushRunning(CPUQueue& q, Task* task, bool front) {
+    auto& queue = q.running[task->Level()];
+    if (queue.head == nullptr) {
+        task->run_prev_ = task->run_next_ = nullptr;
+        queue.head = queue.tail = task;
+        q.running_levels |= static_cast<uint64_t>(1) << task->Level();
+    }
+    else if (front) {
+        task->run_prev_ = nullptr;
+        task->run_next_ = queue.head;
+        queue.head->run_prev_ = task;
+        queue.head = task;
+    }
+    else {
+        task->run_prev_ = queue.tail;
+        task->run_next_ = nullptr;
+        queue.tail->run_next_ = task;
+        queue.tail = task;
     }
 
-    running_[current_level_].pop_front();
-    running_[level].push_front(task);
-    task->SetLevel(level);
-    if (level >= current_level_) {
-        current_level_ = level;
+    if (!task->pinned_) {
+        q.num_unpinned.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void TaskManager::RemoveRunning(CPUQueue& q, Task* task) {
+    auto& queue = q.running[task->Level()];
+    if (task->run_prev_) {
+        task->run_prev_->run_next_ = task->run_next_;
     }
     else {
-        current_level_ = level;
-        level_changed_ = true;
+        queue.head = task->run_next_;
+    }
+    if (task->run_next_) {
+        task->run_next_->run_prev_ = task->run_prev_;
+    }
+    else {
+        queue.tail = task->run_prev_;
+    }
+    task->run_prev_ = task->run_next_ = nullptr;
+
+    if (queue.head == nullptr) {
+        q.running_levels &= ~(static_cast<uint64_t>(1) << task->Level());
+    }
+    if (!task->pinned_) {
+        q.num_unpinned.fetch_sub(1, std::memory_order_relaxed);
     }
 }
 
 void InitializeTask() {
     task_manager = new TaskManager;
-
-    __asm__("cli");
-    timer_manager->AddTimer(Timer{ timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue });
-    __asm__("sti");
 }
-
@@ -4,20 +4,25 @@
 #include <cstddef>
 #include <memory>
 #include <vector>
-#include <deque>
+#include <atomic>
 #include <optional>
 #include "error.hpp"
+#include "fpu.hpp"
 #include "message.hpp"
+#include "queue.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
+#include "task_stack.hpp"
+#include "wait_queue.hpp"
 
 struct TaskContext {
     uint64_t cr3, rip, rflags, reserved1;
     uint64_t cs, ss, fs, gs;
     uint64_t rax, rbx, rcx, rdx, rdi, rsi, rsp, rbp;
     uint64_t r8, r9, r10, r11, r12, r13, r14, r15;
-    std::array<uint8_t, 512> fxsave_area;
+    std::array<uint8_t, kFPUAreaBytes> fpu_area; // FXSAVE/XSAVE の形式。XSAVE のため 64 バイト境界に置く
 } __attribute__((packed));
-
-extern TaskContext task_a_ctx, task_b_ctx;
+static_assert(offsetof(TaskContext, fpu_area) % 64 == 0);
 
 using TaskFunc = void(uint64_t, int64_t);
 
@@ -27,23 +32,58 @@ class Task {
 public:
     static const int kDefaultLevel = 1;
     static const size_t kDefaultStackBytes = 8 * 4096;
+    static const size_t kMessageQueueSize = 256;
     Task(uint64_t id);
-    Task& InitContext(TaskFunc* f, int64_t data);
+    ~Task();
+    // stack_bytes は 4KiB 単位に切り上げる
+    Task& InitContext(TaskFunc* f, int64_t data, size_t stack_bytes = kDefaultStackBytes);
+    // カーネルと共有しない上位半分を持つ、このタスク専用のアドレス空間を作る
+    Error CreateAddressSpace();
     TaskContext& Context();
+    // InitContext していないタスク（起動時のコンテキスト）では bytes が 0
+    const TaskStack& Stack() const { return stack_; }
     Task& Sleep();
     Task& Wakeup();
     uint64_t ID() const;
-    void SendMessage(const Message& msg);
+    // 割り込みハンドラからも割り込みを禁止せずに呼べる
+    void SendMessage(const Message& msg) { PostMessage(msg); NotifyMessages(); }
+    // 積むだけで起こさない。まとめて積んだら NotifyMessages で 1 回だけ知らせる
+    void PostMessage(const Message& msg);
+    void NotifyMessages();
     std::optional<Message> ReceiveMessage();
+    // メッセージが届くまで、最大 timeout ティック眠る。届かなければ std::nullopt。
+    // 0 なら待たない。自分のタスクからだけ呼ぶ
+    std::optional<Message> WaitMessage(unsigned long timeout = kWaitForever);
+    // 受信済みのメッセージを最大 len 個まとめて取り出し、取り出した数を返す
+    size_t ReceiveMessages(Message* msgs, size_t len);
+    template<size_t N>
+    size_t ReceiveMessages(std::array<Message, N>& msgs) { return ReceiveMessages(msgs.data(), N); }
+    // 指定した種類のメッセージは、未受信のものがあれば新たに積まない
+    Task& CoalesceMessages(Message::Type type);
+    // 作成した CPU から他の CPU に移さない。最初に起床させる前に呼ぶ
+    Task& Pin();
+    size_t DroppedMessages() const { return dropped_messages_.load(std::memory_order_relaxed); }
+    size_t CoalescedMessages() const { return coalesced_messages_.load(std::memory_order_relaxed); }
     int Level() const { return level_; }
     bool Running() const { return running_; }
 private:
     uint64_t id_;
-    std::vector<uint64_t> stack_;
-    alignas(16) TaskContext context_;
-    std::deque<Message> msgs_;
+    TaskStack stack_{ 0, 0 };
+    alignas(64) TaskContext context_;
+    MPSCQueue<Message, kMessageQueueSize> msgs_;
+    WaitQueue msg_waiters_; // WaitMessage で待っている間だけ自分が入る
+    uint32_t coalesced_types_{ 0 }; // bit n: Message::Type n をまとめる
+    std::atomic<uint32_t> pending_types_{ 0 }; // まとめる種類のうち未受信のもの
+    std::atomic<size_t> dropped_messages_{ 0 }; // キューが満杯で捨てた数
+    std::atomic<size_t> coalesced_messages_{ 0 };
     unsigned int level_{ kDefaultLevel };
     bool running_{ false };
+    Task* run_prev_{ nullptr }; // 同じレベルの実行待ちリスト
+    Task* run_next_{ nullptr };
+    std::atomic<int> cpu_; // 実行待ちリストを持つ CPU
+    bool pinned_{ false };
+    bool wakeup_pending_{ false }; // 実行中に Wakeup された。次の Sleep を 1 回取り消す
+    Task* finished_next_{ nullptr };
 
     Task& SetLevel(int level) { level_ = level; return *this; }
     Task& SetRunning(bool running) { running_ = running; return *this; }
@@ -51,25 +91,108 @@ private:
     friend TaskManager;
 };
 
+// タスク ID は (世代 << kTaskSlotBits) | スロット番号。
+// スロットを再利用するたびに世代を進めるので、終了したタスクの ID は二度と有効にならない。
+const int kTaskSlotBits = 12;
+const size_t kMaxTasks = static_cast<size_t>(1) << kTaskSlotBits;
+
+// 実行待ちのタスクは CPU ごとのリストに置く。
+// 自分のリストが idle だけになった CPU は、他の CPU のリストからタスクを盗む。
 class TaskManager {
 public:
-    static const int kMaxLevel = 3;
+    // レベルの数は 64 まで増やせる（実行待ちのレベルを uint64_t のビットで持つ）
+    static const int kNumLevels = 32;
+    static const int kMaxLevel = kNumLevels - 1;
+    static_assert(kNumLevels <= 64);
     TaskManager();
     Task& NewTask();
-    void SwitchTask(bool current_sleep = false);
+    // 現在のタスクを終了する。戻らない。
+    [[noreturn]] void Finish();
+    Error Finish(uint64_t id);
+    // この CPU で次のタスクに切り替える。割り込みハンドラからも呼べる
+    void SwitchTask();
     void Sleep(Task* task);
     Error Sleep(uint64_t id);
     void Wakeup(Task* task, int level = -1);
     Error Wakeup(uint64_t id, int level = -1);
     Task& CurrentTask();
     Error SendMessage(uint64_t id, const Message& msg);
+    // ID に対応するタスクがあれば f(Task&) を呼ぶ。なければ kNoSuchTask。
+    // f の間はタスクが破棄されない。f は slots_lock_ を持ち割り込み禁止で呼ばれるので、
+    // 実行待ちリストや待ち行列のロックは取れるが、眠ったりタスクを切り替えたりしてはいけない
+    template <class F>
+    Error WithTask(uint64_t id, F f) {
+        SpinLockGuard guard{ slots_lock_ };
+        Task* task = FindTaskLocked(id);
+        if (task == nullptr) {
+            return MAKE_ERROR(Error::kNoSuchTask);
+        }
+        f(*task);
+        return MAKE_ERROR(Error::kSuccess);
+    }
+    // AP を起動する前に BSP で呼ぶ。AP の起動時のコンテキストがその CPU の idle タスクになる
+    void InitializeCPU(int cpu);
+    // インデックスが num 未満の CPU だけが他の CPU からタスクを盗む（ベンチマーク用）
+    void SetStealingCPUs(int num) { stealing_cpus_ = num; }
+    size_t StolenTasks() const { return stolen_tasks_.load(std::memory_order_relaxed); }
+    struct StackUsage {
+        uint64_t id;
+        size_t bytes;
+        size_t high_water; // TaskStack::HighWaterMark
+    };
+    // 存在するタスクのうち、自分のスタックを持つものを最大 len 個書き込み、その数を返す
+    size_t StackUsages(StackUsage* usages, size_t len);
+    // 全 CPU の実行待ちリストのロックを合計したもの
+    LockStats RunQueueLockContention() const;
+
+    // SwitchTask で切り替わった直後に、切り替え先のタスクが呼ぶ
+    void FinishSwitch();
 private:
-    std::vector<std::unique_ptr<Task>> tasks_{};
-    uint64_t latest_id_{ 0 };
-    std::array<std::deque<Task*>, kMaxLevel + 1> running_{}; // 実行待ちのタスクを保持
-    int current_level_{ kMaxLevel };
-    bool level_changed_{ false };
-    void ChangeLevelRunning(Task* task, int level);
+    struct TaskSlot {
+        std::unique_ptr<Task> task;
+        uint64_t generation;
+        uint32_t next_free; // 空きスロットのリスト。0 は終端
+    };
+
+    SpinLock slots_lock_;
+    std::array<TaskSlot, kMaxTasks> slots_{}; // スロット 0 は使わない
+    uint32_t free_slot_{ 0 };
+    uint32_t unused_slot_{ 1 }; // これ以降のスロットは一度も使われていない
+
+    struct RunQueue {
+        Task* head;
+        Task* tail;
+    };
+
+    // lock は SwitchContext をまたいで保持し、切り替え先のタスクが FinishSwitch で外す。
+    // 保存が終わる前のコンテキストを他の CPU に盗まれないようにするため。
+    struct CPUQueue {
+        SpinLock lock;
+        int cpu;
+        std::array<RunQueue, kNumLevels> running; // 実行待ちのタスクを保持
+        uint64_t running_levels; // bit n が 1 なら running[n] は空でない
+        Task* current; // 実行中のタスクは自分のレベルのリストの先頭にいる
+        Task* idle;
+        std::atomic<int> num_unpinned; // 盗める可能性のあるタスクの数
+        Task* finished; // 自分自身を終了し、スタックの解放を待つタスク
+    };
+
+    std::array<CPUQueue, kMaxCPUs> cpus_{};
+    std::atomic<uint64_t> idle_cpus_{ 0 }; // bit n が 1 なら CPU n は idle タスクを実行中
+    int stealing_cpus_{ kMaxCPUs };
+    std::atomic<size_t> stolen_tasks_{ 0 };
+
+    CPUQueue& ThisCPU() { return cpus_[CurrentCPU()]; }
+    CPUQueue& LockQueueOf(Task* task);
+    void SwitchTaskLocked(CPUQueue& q);
+    Task* Steal(CPUQueue& q);
+    void ChangeLevelRunning(CPUQueue& q, Task* task, int level);
+    void PushRunning(CPUQueue& q, Task* task, bool front = false);
+    void RemoveRunning(CPUQueue& q, Task* task);
+    static int HighestRunningLevel(const CPUQueue& q) { return 63 - __builtin_clzll(q.running_levels); }
+    Task* FindTaskLocked(uint64_t id);
+    std::unique_ptr<Task> ReleaseSlot(uint64_t id);
+    void ReapFinishedTasks();
 };
 
 extern TaskManager* task_manager;
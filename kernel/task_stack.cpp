@@ -0,0 +1,81 @@
+#include <array>
+#include <cstring>
+#include "task_stack.hpp"
+#include "paging.hpp"
+#include "spinlock.hpp"
+
+namespace {
+    const size_t kPageBytes = 4096;
+
+    // これを超えて終了したタスクのスタックはメモリマネージャに返す
+    const size_t kMaxCachedStacks = 16;
+
+    // ロックの順序は stack_lock → demand_lock
+    SpinLock stack_lock;
+    std::array<TaskStack, kMaxCachedStacks> cached_stacks;
+    size_t num_cached = 0;
+    TaskStackStats stats{};
+}
+
+size_t TaskStack::HighWaterMark() const {
+    auto p = reinterpret_cast<const uint64_t*>(base);
+    const auto end = reinterpret_cast<const uint64_t*>(End());
+    while(p < end && *p == 0) {
+        ++p;
+    }
+    return End() - reinterpret_cast<uint64_t>(p);
+}
+
+WithError<TaskStack> AllocateTaskStack(size_t bytes) {
+    bytes = (bytes + kPageBytes - 1) & ~(kPageBytes - 1);
+    {
+        SpinLockGuard guard{stack_lock};
+        ++stats.allocations;
+        ++stats.in_use;
+        for(size_t i = 0; i < num_cached; ++i) {
+            if(cached_stacks[i].bytes == bytes) {
+                const TaskStack stack = cached_stacks[i];
+                cached_stacks[i] = cached_stacks[--num_cached];
+                ++stats.reused;
+                return {stack, MAKE_ERROR(Error::kSuccess)};
+            }
+        }
+    }
+
+    auto [ base, err ] = ReserveGuarded(bytes, kStackGuardBytes);
+    if(err) {
+        SpinLockGuard guard{stack_lock};
+        --stats.in_use;
+        return {{0, 0}, err};
+    }
+    return {{base, bytes}, MAKE_ERROR(Error::kSuccess)};
+}
+
+void FreeTaskStack(const TaskStack& stack) {
+    if(stack.bytes == 0) {
+        return;
+    }
+
+    // 使われた部分だけ 0 に戻せば、次の持ち主にも HighWaterMark が正しく求まる
+    const size_t used = stack.HighWaterMark();
+    memset(reinterpret_cast<void*>(stack.End() - used), 0, used);
+    {
+        SpinLockGuard guard{stack_lock};
+        --stats.in_use;
+        if(used > stats.max_high_water) {
+            stats.max_high_water = used;
+        }
+        if(num_cached < kMaxCachedStacks) {
+            cached_stacks[num_cached++] = stack;
+            return;
+        }
+    }
+    ReleaseDemandZero(stack.base - kStackGuardBytes, kStackGuardBytes + stack.bytes);
+}
+
+TaskStackStats GetTaskStackStats() {
+    SpinLockGuard guard{stack_lock};
+    TaskStackStats s = stats;
+    s.cached = num_cached;
+    return s;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include "error.hpp"
+
+// タスクのスタック。[base, base + bytes) の直下に写像しないガードページを置くので、
+// 溢れるとページフォールト（kStackOverflow）になる
+struct TaskStack {
+    uint64_t base;
+    size_t bytes;
+
+    uint64_t End() const { return base + bytes; }
+    // これまでに使われた最大のバイト数。スタックは 0 で埋めて渡すので、
+    // 一番下の 0 でない値の位置から求める
+    size_t HighWaterMark() const;
+};
+
+const size_t kStackGuardBytes = 4096;
+
+// bytes は 4KiB 単位に切り上げる。終了したタスクのスタックを同じ大きさなら再利用する
+WithError<TaskStack> AllocateTaskStack(size_t bytes);
+void FreeTaskStack(const TaskStack& stack);
+
+struct TaskStackStats {
+    size_t in_use;          // 使用中のスタックの数
+    size_t cached;          // 再利用のためにとってあるスタックの数
+    size_t allocations;     // AllocateTaskStack の回数
+    size_t reused;          // そのうち、とってあったものを使った回数
+    size_t max_high_water;  // 解放されたスタックの HighWaterMark の最大値
+};
+TaskStackStats GetTaskStackStats();
@@ -1,10 +1,60 @@
+#include <algorithm>
 #include <cstring>
+#include <memory>
 #include "terminal.hpp"
 #include "font.hpp"
 #include "layer.hpp"
 #include "logger.hpp"
 #include "pci.hpp"
 #include "fat.hpp"
+#include "memory_manager.hpp"
+#include "buddy_memory_manager.hpp"
+#include "slab.hpp"
+#include "usb/memory.hpp"
+#include "paging.hpp"
+#include "asmfunc.h"
+#include "smp.hpp"
+#include "timer.hpp"
+#include "fpu.hpp"
+#include "clock.hpp"
+#include "acpi.hpp"
+#include "hpet.hpp"
+
+namespace {
+    // schedbench で端末タスクと交互に実行されるだけのタスク
+    void SchedBenchPeer(uint64_t task_id, int64_t data) {
+        while (true) {
+            task_manager->SwitchTask();
+        }
+    }
+
+    // SSE を使う。タスクは切り替わるたびに FPU の状態の保存と復元（#NM）が必要になる
+    void TouchFPU() {
+        __asm__ volatile("addsd %%xmm0, %%xmm0" ::: "xmm0");
+    }
+
+    void SchedBenchFPUPeer(uint64_t task_id, int64_t data) {
+        while (true) {
+            TouchFPU();
+            task_manager->SwitchTask();
+        }
+    }
+
+    // stealbench で動かす、計算だけして終わるタスク
+    const int kStealBenchWorkers = 16;
+    std::atomic<int> stealbench_remaining{ 0 };
+    WaitQueue stealbench_done;
+
+    void StealBenchWorker(uint64_t task_id, int64_t data) {
+        volatile uint64_t sum = 0;
+        for (int64_t i = 0; i < data; ++i) {
+            sum += i;
+        }
+        if (stealbench_remaining.fetch_sub(1) == 1) {
+            stealbench_done.WakeAll();
+        }
+    }
+}
 
 Terminal::Terminal() {
     window_ = std::make_shared<ToplevelWindow>(
@@ -220,6 +270,367 @@ void Terminal::ExecuteLine() {
             DrawCursor(true);
         }
     }
+    else if (strcmp(command, "memstat") == 0) {
+        char s[64];
+        const size_t kib_per_frame = kBytesPerFrame / 1024;
+        const auto heap = GetHeapStat();
+        sprintf(s, "heap: %lu KiB reserved, %lu KiB in use, %lu KiB peak\n",
+            heap.frames * kib_per_frame, heap.bytes_in_use / 1024,
+            heap.high_water_mark / 1024);
+        Print(s);
+
+        size_t slabs = 0, objects = 0;
+        for (const auto& cache : slab_caches) {
+            slabs += cache.SlabCount();
+            objects += cache.ObjectsInUse();
+        }
+        sprintf(s, "slab: %lu slabs, %lu objects, large objects %lu KiB\n",
+            slabs, objects, LargeObjectFrames() * kib_per_frame);
+        Print(s);
+
+        sprintf(s, "reclaimed after boot: %lu KiB\n", ReclaimedFrames() * kib_per_frame);
+        Print(s);
+
+        if (memory_manager_type == MemoryManagerType::kBuddy) {
+            // 4 KiB << order のブロックがいくつ空いているか
+            auto buddy = static_cast<BuddyMemoryManager*>(memory_manager);
+            Print("buddy free blocks:");
+            for (int order = 0; order <= BuddyMemoryManager::kMaxOrder; ++order) {
+                sprintf(s, " %lu", buddy->FreeBlocks(order));
+                Print(s);
+            }
+            Print("\n");
+        }
+        else {
+            Print("frame allocator: bitmap\n");
+        }
+
+        const auto usb_mem = usb::GetMemoryStat();
+        sprintf(s, "usb: %lu KiB pool, %lu KiB in use, %lu KiB peak\n",
+            usb_mem.pool_bytes / 1024, usb_mem.bytes_in_use / 1024,
+            usb_mem.high_water_mark / 1024);
+        Print(s);
+    }
+    else if (strcmp(command, "msgstat") == 0) {
+        char s[64];
+        for (uint64_t id : { uint64_t{ 1 }, task_manager->CurrentTask().ID() }) {
+            // Print は眠ることがあるので、WithTask の中では値を写すだけにする
+            size_t dropped = 0, coalesced = 0;
+            auto err = task_manager->WithTask(id, [&](Task& task) {
+                dropped = task.DroppedMessages();
+                coalesced = task.CoalescedMessages();
+            });
+            if (!err) {
+                sprintf(s, "task %lu: %lu dropped, %lu coalesced\n", id, dropped, coalesced);
+                Print(s);
+            }
+        }
+    }
+    else if (strcmp(command, "cpus") == 0) {
+        char s[64];
+        sprintf(s, "tick %lu (%s)\n", timer_manager->CurrentTick(), tickless ? "tickless" : "periodic");
+        Print(s);
+        for (int i = 0; i < num_cpus; ++i) {
+            sprintf(s, "cpu %d: APIC ID %u, %lu timer interrupts\n", i, cpus[i].apic_id, cpus[i].ticks);
+            Print(s);
+        }
+    }
+    else if (strcmp(command, "clock") == 0) {
+        // 時刻を読むコストを PM タイマ（I/O ポート）と比べる
+        const int kReads = 1000;
+        char s[80];
+        sprintf(s, "TSC %lu kHz%s, now %lu ns\n", tsc_freq / 1000,
+            TSCInvariant() ? " (invariant)" : "", NowNanoseconds());
+        Print(s);
+        for (int i = 1; i < num_cpus; ++i) {
+            sprintf(s, "cpu %d: offset %ld cycles\n", i, ClockOffset(i));
+            Print(s);
+        }
+
+        volatile uint64_t sink;
+        auto start = ReadTSC();
+        for (int i = 0; i < kReads; ++i) {
+            sink = NowNanoseconds();
+        }
+        const uint64_t clock_cycles = (ReadTSC() - start) / kReads;
+        start = ReadTSC();
+        for (int i = 0; i < kReads; ++i) {
+            sink = acpi::ReadPMTimer();
+        }
+        const uint64_t pm_cycles = (ReadTSC() - start) / kReads;
+        (void)sink;
+        sprintf(s, "NowNanoseconds: %lu cycles, PM timer: %lu cycles\n", clock_cycles, pm_cycles);
+        Print(s);
+    }
+    else if (strcmp(command, "timersrc") == 0) {
+        // BSP のタイマの期限を知らせる装置を切り替える（端末タスクは BSP に固定されている）
+        if (first_arg && (strcmp(first_arg, "hpet") == 0 || strcmp(first_arg, "lapic") == 0)) {
+            if (auto err = UseHPETEvents(strcmp(first_arg, "hpet") == 0)) {
+                char s[64];
+                sprintf(s, "timersrc: %s\n", err.Name());
+                Print(s);
+            }
+        }
+        else if (first_arg) {
+            Print("usage: timersrc [hpet|lapic]\n");
+        }
+        char s[80];
+        sprintf(s, "timer events: %s", HPETEventsEnabled() ? "HPET" : "local APIC");
+        Print(s);
+        if (HPETAvailable()) {
+            sprintf(s, " (HPET %lu kHz, counter %lu)", hpet_freq / 1000, ReadHPETCounter());
+            Print(s);
+        }
+        Print("\n");
+    }
+    else if (strcmp(command, "lockstat") == 0) {
+        const std::pair<const char*, LockStats> stats[] = {
+            { "run queue", task_manager->RunQueueLockContention() },
+            { "timer", timer_manager->LockContention() },
+            { "frame", memory_manager->LockContention() },
+            { "slab", SlabLockContention() },
+            { "layer", layer_mutex.Stats() },
+        };
+        char s[80];
+        for (const auto& [ name, stat ] : stats) {
+            sprintf(s, "%-9s: %lu acquired, %lu contended, %lu waits\n",
+                name, stat.acquisitions, stat.contentions, stat.waits);
+            Print(s);
+        }
+    }
+    else if (strcmp(command, "timerbench") == 0) {
+        // 保留中のタイマの数を変えて、Tick 1 回あたりのサイクル数を測る。
+        // 期限は 100000 ティック先までばらまくので、上のレベルからの振り分けも起きる
+        const int kTicks = 10000;
+        const size_t kPending[] = { 0, 1000, 4000, 8000 };
+        char s[80];
+        for (const size_t n : kPending) {
+            auto bench = std::make_unique<TimerManager>();
+            uint32_t seed = 12345;
+            auto start = ReadTSC();
+            for (size_t i = 0; i < n; ++i) {
+                seed = seed * 1103515245 + 12345;
+                bench->AddTimer(Timer{ 1 + (seed >> 8) % 100000, kTaskWakeupValue, 0 });
+            }
+            const uint64_t add_cycles = n ? (ReadTSC() - start) / n : 0;
+
+            uint64_t total = 0, worst = 0;
+            {
+                InterruptGuard guard;
+                for (int i = 0; i < kTicks; ++i) {
+                    start = ReadTSC();
+                    bench->Tick();
+                    const uint64_t cycles = ReadTSC() - start;
+                    total += cycles;
+                    worst = std::max(worst, cycles);
+                }
+            }
+            sprintf(s, "%5lu timers: add %lu, tick avg %lu max %lu cycles, %lu left\n",
+                n, add_cycles, total / kTicks, worst, bench->PendingTimers());
+            Print(s);
+        }
+    }
+    else if (strcmp(command, "allocbench") == 0) {
+        // 断片化したビットマップ（4 GiB 分）で、1 ビットずつの先頭からの探索と
+        // map line 単位・next-fit の探索を比べる。前 7/8 は 16 フレームに 1 つだけ空いている
+        const size_t kFrames = 1024 * 1024;
+        const int kAllocs = 64;
+        const size_t kSizes[] = { 1, 16, 256 };
+        auto bench = std::make_unique<BitmapMemoryManager>();
+        auto fragment = [&]() {
+            bench->SetMemoryRange(FrameID{ 0 }, FrameID{ kFrames });
+            bench->MarkAllocated(FrameID{ 0 }, kFrames);
+            uint32_t seed = 12345;
+            for (size_t frame = 0; frame < kFrames / 8 * 7; frame += 16) {
+                seed = seed * 1103515245 + 12345;
+                bench->Free(FrameID{ frame + (seed >> 8) % 16 }, 1);
+            }
+            bench->Free(FrameID{ kFrames / 8 * 7 }, kFrames / 8);
+        };
+        auto measure = [&](size_t num_frames, bool first_fit) {
+            fragment();
+            std::array<size_t, kAllocs> frames;
+            const auto start = ReadTSC();
+            for (int i = 0; i < kAllocs; ++i) {
+                const auto result = first_fit ?
+                    bench->AllocateFirstFit(num_frames) : bench->Allocate(num_frames);
+                frames[i] = result.value.ID();
+            }
+            const uint64_t cycles = (ReadTSC() - start) / kAllocs;
+            for (const size_t frame : frames) {
+                if (frame != kNullFrame.ID()) {
+                    bench->Free(FrameID{ frame }, num_frames);
+                }
+            }
+            return cycles;
+        };
+
+        char s[80];
+        for (const size_t n : kSizes) {
+            const uint64_t first_fit = measure(n, true);
+            const uint64_t word_scan = measure(n, false);
+            sprintf(s, "%3lu frames: first-fit %lu, word scan %lu cycles/alloc\n",
+                n, first_fit, word_scan);
+            Print(s);
+        }
+    }
+    else if (strcmp(command, "cowtest") == 0) {
+        // 要求時ゼロの領域を複製し、両方に書いて内容が分かれることを確かめる。
+        // ページ 0, 1 は複製前に書き、ページ 2 は触らないでおく
+        const size_t kPages = 3;
+        const size_t kBytes = kPages * 4096;
+        auto [ orig_addr, orig_err ] = ReserveDemandZero(kBytes);
+        if (orig_err) {
+            Print("cowtest: failed to reserve\n");
+            return;
+        }
+        auto orig = reinterpret_cast<volatile uint64_t*>(orig_addr);
+        const size_t kWordsPerPage = 4096 / sizeof(uint64_t);
+        orig[0] = 0x1111;
+        orig[kWordsPerPage] = 0x2222;
+
+        auto [ clone_addr, clone_err ] = CloneCopyOnWrite(orig_addr, kBytes);
+        if (clone_err) {
+            ReleaseDemandZero(orig_addr, kBytes);
+            Print("cowtest: failed to clone\n");
+            return;
+        }
+        auto clone = reinterpret_cast<volatile uint64_t*>(clone_addr);
+        bool ok = clone[0] == 0x1111 && clone[kWordsPerPage] == 0x2222 &&
+                  clone[2 * kWordsPerPage] == 0;
+        clone[0] = 0x3333;                // 複製側が書く
+        orig[kWordsPerPage] = 0x4444;     // 元の側が書く
+        clone[2 * kWordsPerPage] = 0x5555; // 共有していないページ
+        ok = ok && orig[0] == 0x1111 && clone[0] == 0x3333 &&
+             orig[kWordsPerPage] == 0x4444 && clone[kWordsPerPage] == 0x2222 &&
+             orig[2 * kWordsPerPage] == 0 && clone[2 * kWordsPerPage] == 0x5555;
+        // 最後の持ち主になった側の書き込みはコピーせずに済む
+        orig[0] = 0x6666;
+        clone[kWordsPerPage] = 0x7777;
+        ok = ok && orig[0] == 0x6666 && clone[0] == 0x3333 &&
+             orig[kWordsPerPage] == 0x4444 && clone[kWordsPerPage] == 0x7777;
+
+        ReleaseDemandZero(clone_addr, kBytes);
+        ReleaseDemandZero(orig_addr, kBytes);
+        Print(ok ? "cowtest: ok\n" : "cowtest: FAILED\n");
+    }
+    else if (strcmp(command, "stacks") == 0) {
+        // タスクごとのスタックの大きさと、これまでに使われた最大の量
+        std::array<TaskManager::StackUsage, 16> usages;
+        const size_t n = task_manager->StackUsages(usages.data(), usages.size());
+        char s[80];
+        for (size_t i = 0; i < n; ++i) {
+            sprintf(s, "task %lx: %lu / %lu bytes used\n",
+                usages[i].id, usages[i].high_water, usages[i].bytes);
+            Print(s);
+        }
+        const auto stats = GetTaskStackStats();
+        sprintf(s, "%lu in use, %lu cached, %lu/%lu reused, max %lu bytes used\n",
+            stats.in_use, stats.cached, stats.reused, stats.allocations, stats.max_high_water);
+        Print(s);
+    }
+    else if (strcmp(command, "blit") == 0) {
+        // 画面全体の転送にかかるサイクル数を WB と WC で比べる
+        const int kFrames = 16;
+        const Rectangle<int> screen_area{ { 0, 0 }, ScreenSize() };
+        auto measure = [&](bool write_combining) {
+            if (auto err = SetFrameBufferWriteCombining(write_combining)) {
+                Log(kError, "failed to remap frame buffer: %s\n", err.Name());
+            }
+            LockGuard<Mutex> lock{ layer_mutex };
+            InterruptGuard guard; // 計測中に割り込まれないように
+            const auto start = ReadTSC();
+            for (int i = 0; i < kFrames; ++i) {
+                layer_manager->CopyToScreen(screen_area);
+            }
+            return (ReadTSC() - start) / kFrames;
+        };
+
+        const auto wb_cycles = measure(false);
+        const auto wc_cycles = measure(true);
+        char s[64];
+        sprintf(s, "WB: %lu kcycles/frame\n", wb_cycles / 1000);
+        Print(s);
+        sprintf(s, "WC: %lu kcycles/frame (x%lu.%02lu)\n", wc_cycles / 1000,
+            wb_cycles / wc_cycles, wb_cycles * 100 / wc_cycles % 100);
+        Print(s);
+    }
+    else if (strcmp(command, "schedbench") == 0) {
+        // 起床（Wakeup + Sleep）とコンテキストスイッチにかかるサイクル数を測る
+        const int kIterations = 10000;
+        Task& current = task_manager->CurrentTask();
+        // 交互に実行させたいので、他の CPU に盗まれないようにする
+        Task& peer = task_manager->NewTask().InitContext(SchedBenchPeer, 0).Pin();
+        Task& fpu_peer = task_manager->NewTask().InitContext(SchedBenchFPUPeer, 0).Pin();
+
+        uint64_t wakeup_cycles, switch_cycles, fpu_switch_cycles;
+        size_t fpu_traps;
+        {
+            InterruptGuard guard; // 計測中にタイマで切り替わらないように
+            auto start = ReadTSC();
+            for (int i = 0; i < kIterations; ++i) {
+                task_manager->Wakeup(&peer, current.Level());
+                task_manager->Sleep(&peer);
+            }
+            wakeup_cycles = (ReadTSC() - start) / kIterations;
+
+            // peer と交互に実行するので、1 回の SwitchTask で 2 回切り替わる
+            task_manager->Wakeup(&peer, current.Level());
+            start = ReadTSC();
+            for (int i = 0; i < kIterations; ++i) {
+                task_manager->SwitchTask();
+            }
+            switch_cycles = (ReadTSC() - start) / (2 * kIterations);
+            task_manager->Finish(peer.ID());
+
+            // 両方のタスクが毎回 FPU を使う場合
+            task_manager->Wakeup(&fpu_peer, current.Level());
+            const size_t traps = FPUTraps();
+            start = ReadTSC();
+            for (int i = 0; i < kIterations; ++i) {
+                TouchFPU();
+                task_manager->SwitchTask();
+            }
+            fpu_switch_cycles = (ReadTSC() - start) / (2 * kIterations);
+            fpu_traps = FPUTraps() - traps;
+            task_manager->Finish(fpu_peer.ID());
+        }
+
+        char s[64];
+        sprintf(s, "wakeup+sleep: %lu cycles\n", wakeup_cycles);
+        Print(s);
+        sprintf(s, "context switch: %lu cycles\n", switch_cycles);
+        Print(s);
+        sprintf(s, "context switch with FPU: %lu cycles, %lu #NM\n", fpu_switch_cycles, fpu_traps);
+        Print(s);
+    }
+    else if (strcmp(command, "stealbench") == 0) {
+        // 計算だけするタスクを、盗みに行く CPU の数を変えて動かし、全部終わるまでの時間を測る
+        const int64_t kWork = 20000000;
+        char s[64];
+        uint64_t base_cycles = 0;
+        for (int n = 1; n <= num_cpus; ++n) {
+            task_manager->SetStealingCPUs(n);
+            const size_t stolen = task_manager->StolenTasks();
+            stealbench_remaining = kStealBenchWorkers;
+
+            const auto start = ReadTSC();
+            for (int i = 0; i < kStealBenchWorkers; ++i) {
+                task_manager->NewTask().InitContext(StealBenchWorker, kWork).Wakeup();
+            }
+            stealbench_done.Wait([]() { return stealbench_remaining.load() == 0; });
+            const uint64_t cycles = ReadTSC() - start;
+            if (n == 1) {
+                base_cycles = cycles;
+            }
+
+            sprintf(s, "%d CPUs: %lu Mcycles, x%lu.%02lu, %lu stolen\n",
+                n, cycles / 1000000, base_cycles / cycles, base_cycles * 100 / cycles % 100,
+                task_manager->StolenTasks() - stolen);
+            Print(s);
+        }
+        task_manager->SetStealingCPUs(kMaxCPUs);
+    }
     else if (command[0] != 0) {
         Print("no such command: ");
         Print(command);
@@ -256,20 +667,27 @@ Rectangle<int> Terminal::HistoryUpDown(int direction) {
 }
 
 void TaskTerminal(uint64_t task_id, int64_t data) {
-    __asm__("cli");
     Task& task = task_manager->CurrentTask();
-    Terminal* terminal = new Terminal;
-    layer_manager->Move(terminal->LayerID(), { 100, 200 });
-    active_layer->Activate(terminal->LayerID());
-    layer_task_map->insert(std::make_pair(terminal->LayerID(), task_id));
-    __asm__("sti");
+    Terminal* terminal;
+    {
+        LockGuard<Mutex> lock{ layer_mutex };
+        terminal = new Terminal;
+        layer_manager->Move(terminal->LayerID(), { 100, 200 });
+        active_layer->Activate(terminal->LayerID());
+        layer_task_map->insert(std::make_pair(terminal->LayerID(), task_id));
+    }
 
+    // カーソルは、次に点滅させる時刻までメッセージを待つ間に点滅させる
+    const unsigned long kCursorBlinkTicks = kTimerFreq / 2;
+    unsigned long next_blink = timer_manager->CurrentTick() + kCursorBlinkTicks;
     while (true) {
-        __asm__("cli");
-        auto msg = task.ReceiveMessage();
+        const unsigned long now = timer_manager->CurrentTick();
+        auto msg = task.WaitMessage(next_blink > now ? next_blink - now : 0);
         if (!msg) {
-            task.Sleep();
-            __asm__("sti");
+            next_blink = timer_manager->CurrentTick() + kCursorBlinkTicks;
+            const auto area = terminal->BlinkCursor();
+            task_manager->SendMessage(1, MakeLayerMessage(
+                task_id, terminal->LayerID(), LayerOperation::DrawArea, area));
             continue;
         }
 
@@ -280,18 +698,7 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
             const auto area = terminal->InputKey(msg->arg.keyboard.modifier, msg->arg.keyboard.keycode, msg->arg.keyboard.ascii);
             Message msg = MakeLayerMessage(
                 task_id, terminal->LayerID(), LayerOperation::DrawArea, area);
-            __asm__("cli");
-            task_manager->SendMessage(1, msg);
-            __asm__("sti");
-        }
-        break;
-        case Message::kTimerTimeout:
-        {
-            const auto area = terminal->BlinkCursor();
-            Message msg = MakeLayerMessage(task_id, terminal->LayerID(), LayerOperation::DrawArea, area);
-            __asm__("cli");
             task_manager->SendMessage(1, msg);
-            __asm__("sti");
         }
         break;
         default:
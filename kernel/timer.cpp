@@ -1,8 +1,18 @@
+#include <algorithm>
 #include <limits>
 #include "timer.hpp"
 #include "interrupt.hpp"
 #include "acpi.hpp"
+#include "asmfunc.h"
+#include "clock.hpp"
+#include "hpet.hpp"
 #include "task.hpp"
+#include "smp.hpp"
+#include "logger.hpp"
+
+TimerManager* timer_manager;
+unsigned long lapic_timer_freq; // APICタイマの周波数
+bool tickless = false;
 
 namespace {
     const uint32_t kCountMax = 0xffffffffu;
@@ -10,74 +20,470 @@ namespace {
     volatile uint32_t& initial_count = *reinterpret_cast<uint32_t*>(0xfee00380);
     volatile uint32_t& current_count = *reinterpret_cast<uint32_t*>(0xfee00390);
     volatile uint32_t& divide_config = *reinterpret_cast<uint32_t*>(0xfee003e0);
+
+    const uint32_t kLVTOneShot = 0b000 << 16;
+    const uint32_t kLVTPeriodic = 0b010 << 16;
+    const uint32_t kLVTTSCDeadline = 0b100 << 16;
+    const uint32_t kIA32TSCDeadline = 0x6e0;
+
+    bool tsc_deadline = false;  // tickless のとき、単発モードの代わりに TSC-deadline モードを使う
+    uint64_t tsc_base;          // ティック 0 の TSC（BSP の値）
+    uint64_t tsc_per_tick;
+    uint64_t tsc_per_slice;
+
+    unsigned long TickOf(uint64_t tsc) {
+        return (tsc - tsc_base) / tsc_per_tick;
+    }
+
+    // BSP のタイマの期限を HPET のタイマ 0 で知らせる。Local APIC タイマは時間切れだけに使う
+    bool hpet_events = false;
+    bool hpet_routed = false;
+
+    // BSP の次のタイマの期限の TSC。なければ 0
+    uint64_t NextEventTSC() {
+        const auto next = timer_manager->NextEvent();
+        return next == TimerManager::kNoEvent ? 0 : tsc_base + next * tsc_per_tick;
+    }
+
+    void ArmHPETEvent(uint64_t event, uint64_t now) {
+        if(event == 0) {
+            StopHPETEvent();
+            return;
+        }
+        // 1 秒より先なら一度途中で鳴らす（掛け算があふれないように）
+        const uint64_t delta = std::min(event > now ? event - now : 0, tsc_freq);
+        SetHPETEvent(ReadHPETCounter() + delta * hpet_freq / tsc_freq);
+    }
+
+    // この CPU の Local APIC タイマを、時間切れと（BSP なら）次のタイマの早いほうに合わせる。
+    // 割り込み禁止で呼ぶ
+    void ArmLAPICTimer(uint64_t now) {
+        const int cpu = CurrentCPU();
+        uint64_t deadline = cpus[cpu].slice_end;
+        if(cpu == 0) {
+            const uint64_t event = NextEventTSC();
+            if(hpet_events) {
+                ArmHPETEvent(event, now);
+            }
+            else if(event != 0 && (deadline == 0 || event < deadline)) {
+                deadline = event;
+            }
+        }
+
+        if(tsc_deadline) {
+            WriteMSR(kIA32TSCDeadline, deadline); // 0 なら止まる。過ぎていればすぐ鳴る
+            return;
+        }
+        if(deadline == 0) {
+            initial_count = 0;
+            return;
+        }
+        // 1 秒より先なら一度途中で鳴らす（掛け算があふれないように）
+        const uint64_t delta = std::min(deadline > now ? deadline - now : 1, tsc_freq);
+        initial_count = std::max<uint64_t>(1, delta * lapic_timer_freq / tsc_freq);
+    }
+
+    // BSP のタイマに、今設定しているより早い期限ができた
+    void RearmBSPTimer() {
+        if(!tickless) {
+            return;
+        }
+        if(CurrentCPU() != 0) {
+            SendIPI(0, InterruptVector::kLAPICTimer); // BSP の割り込みハンドラが設定し直す
+            return;
+        }
+        InterruptGuard guard;
+        ArmLAPICTimer(ReadTSC());
+    }
 }
 
-TimerManager* timer_manager;
-unsigned long lapic_timer_freq; // APICタイマの周波数
+TimerManager::TimerManager() {
+    for(auto& level : wheel_) {
+        for(auto& head : level) {
+            head.prev = head.next = &head;
+        }
+    }
+}
+
+TimerManager::TimerNode* TimerManager::FindNode(uint64_t id) {
+    const uint32_t slot = id & (kMaxTimers - 1);
+    if(slot == 0 || slot >= unused_node_) {
+        return nullptr;
+    }
+    auto& node = nodes_[slot];
+    if(node.link.next == nullptr || node.generation != (id >> kTimerSlotBits)) {
+        return nullptr;
+    }
+    return &node;
+}
+
+// lock_ を取った状態で呼ぶ。期限が tick_ から何ティック先かでレベルを決める。
+// earliest より前の期限は earliest に置く。ProcessTick の振り分け中は tick_ の分をこの後で
+// 処理するので earliest は tick_、それ以外は tick_ + 1。
+// 置いたスロットを処理するティックを返す
+unsigned long TimerManager::Place(TimerNode& node, unsigned long earliest) {
+    unsigned long timeout = node.timer.Timeout();
+    if(timeout < earliest) {
+        timeout = earliest;
+    }
+    int level = 0;
+    while(level < kWheelLevels - 1 &&
+          timeout - tick_ >= (1ul << (kWheelBits * (level + 1)))) {
+        ++level;
+    }
+    if(level == kWheelLevels - 1 &&
+       timeout - tick_ >= (1ul << (kWheelBits * kWheelLevels))) {
+        // 最上位のレベルでも 1 周に収まらないので、届く一番遠いスロットに置いて振り分け直す
+        timeout = tick_ + (1ul << (kWheelBits * kWheelLevels)) - 1;
+    }
+
+    const int shift = kWheelBits * level;
+    auto& head = wheel_[level][(timeout >> shift) & (kWheelSlots - 1)];
+    node.link.prev = head.prev;
+    node.link.next = &head;
+    head.prev->next = &node.link;
+    head.prev = &node.link;
+    return (timeout >> shift) << shift;
+}
+
+// lock_ を取った状態で呼ぶ
+unsigned long TimerManager::FindNextEvent() const {
+    unsigned long next = kNoEvent;
+    for(int level = 0; level < kWheelLevels; ++level) {
+        const int shift = kWheelBits * level;
+        const unsigned long base = tick_ >> shift;
+        for(unsigned long d = 1; d <= kWheelSlots; ++d) {
+            const auto& head = wheel_[level][(base + d) & (kWheelSlots - 1)];
+            if(head.next != &head) {
+                next = std::min(next, (base + d) << shift);
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+void TimerManager::Unlink(Link& link) {
+    link.prev->next = link.next;
+    link.next->prev = link.prev;
+    link.prev = link.next = nullptr;
+}
+
+// スロットの中身を、終端が nullptr のリストとして切り離す
+TimerManager::Link* TimerManager::Detach(Link& head) {
+    if(head.next == &head) {
+        return nullptr;
+    }
+    Link* first = head.next;
+    head.prev->next = nullptr;
+    head.prev = head.next = &head;
+    return first;
+}
+
+// 今のスロットに来たレベル level のタイマを下のレベルに振り分ける
+void TimerManager::Cascade(int level) {
+    auto& head = wheel_[level][(tick_ >> (kWheelBits * level)) & (kWheelSlots - 1)];
+    Link* link = Detach(head);
+    while(link) {
+        Link* next = link->next;
+        Place(*reinterpret_cast<TimerNode*>(link), tick_);
+        link = next;
+    }
+}
+
+void TimerManager::FreeNode(TimerNode& node) {
+    node.link.prev = node.link.next = nullptr;
+    ++node.generation;
+    const uint32_t slot = &node - &nodes_[0];
+    node.next_free = free_node_;
+    free_node_ = slot;
+    --pending_;
+}
+
+// 同じティックに期限の来たタイマを、持ち主のタスクごとにまとめて届ける。
+// メッセージを全部積んでから知らせるので、起床は 1 タスクにつき 1 回で済む
+void TimerManager::FireExpired(Link* expired) {
+    while(expired) {
+        const uint64_t owner = reinterpret_cast<TimerNode*>(expired)->timer.TaskID();
+        // 持ち主の分をリストから外して届ける。task が nullptr（終了したタスク）なら捨てるだけ
+        auto deliver = [&](Task* task) {
+            bool wakeup = false;
+            bool posted = false;
+
+            Link** prev = &expired;
+            Link* link = expired;
+            while(link) {
+                Link* next = link->next;
+                auto& node = *reinterpret_cast<TimerNode*>(link);
+                if(node.timer.TaskID() != owner) {
+                    prev = &link->next;
+                    link = next;
+                    continue;
+                }
+                *prev = next;
+                const Timer t = node.timer;
+                FreeNode(node);
+                link = next;
+
+                if(t.Value() == kTaskWakeupValue) {
+                    wakeup = true;
+                }
+                else if(task) {
+                    Message m{Message::kTimerTimeout};
+                    m.arg.timer.timeout = t.Timeout();
+                    m.arg.timer.value = t.Value();
+                    task->PostMessage(m);
+                    posted = true;
+                }
+            }
 
-bool TimerManager::Tick() {
-    ++tick_;
-    bool task_timer_timeout = false;
-    // 割り込みのたびにtime outしたタイマがないか調べる
-    while(true) {
-        const auto& t = timers_.top();
-        if(t.Timeout() > tick_) {
+            if(posted) {
+                task->NotifyMessages();
+            }
+            if(wakeup && task) {
+                task_manager->Wakeup(task);
+            }
+        };
+        // 届けている間に持ち主が破棄されないように WithTask の中で届ける
+        if(task_manager->WithTask(owner, [&](Task& task) { deliver(&task); })) {
+            deliver(nullptr);
+        }
+    }
+}
+
+// lock_ を取った状態で、tick_ を進めてから呼ぶ
+void TimerManager::ProcessTick() {
+    // 上のレベルから順に振り分けるので、期限がちょうど tick_ のタイマもレベル 0 まで降りてくる
+    for(int level = kWheelLevels - 1; level > 0; --level) {
+        if((tick_ & ((1ul << (kWheelBits * level)) - 1)) == 0) {
+            Cascade(level);
+        }
+    }
+
+    FireExpired(Detach(wheel_[0][tick_ & (kWheelSlots - 1)]));
+}
+
+unsigned long TimerManager::CurrentTick() const {
+    // tick_ を書くのは AdvanceTo だけなのでロック不要
+    if(!tickless) {
+        return tick_;
+    }
+    // 処理済みのティックより前には戻らない（AP の TSC のずれが残っていても）
+    const unsigned long tick = tick_;
+    return std::max(tick, TickOf(ClockTSC()));
+}
+
+void TimerManager::AdvanceTo(unsigned long tick) {
+    SpinLockGuard guard{lock_};
+    while(tick_ < tick) {
+        // 間のスロットは空で、振り分けても何も起きない
+        const unsigned long next = FindNextEvent();
+        if(next > tick) {
+            tick_ = tick;
             break;
         }
+        tick_ = next;
+        ProcessTick();
+    }
+    next_event_.store(FindNextEvent(), std::memory_order_relaxed);
+}
 
-        if(t.Value() == kTaskTimerValue) {
-            task_timer_timeout = true;
-            timers_.pop();
-            timers_.push(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue});
-            continue;
+uint64_t TimerManager::AddTimer(const Timer& timer) {
+    uint64_t id;
+    bool earlier;
+    {
+        SpinLockGuard guard{lock_};
+        uint32_t slot = free_node_;
+        if(slot != 0) {
+            free_node_ = nodes_[slot].next_free;
+        }
+        else if(unused_node_ < kMaxTimers) {
+            slot = unused_node_++;
+        }
+        else {
+            Log(kError, "AddTimer: no free timer (max %lu)\n", kMaxTimers - 1);
+            return 0;
         }
 
-        Message m{Message::kTimerTimeout};
-        m.arg.timer.timeout = t.Timeout();
-        m.arg.timer.value = t.Value();
-        task_manager->SendMessage(1, m);
-        timers_.pop();
+        auto& node = nodes_[slot];
+        node.timer = timer;
+        earlier = UpdateNextEvent(Place(node, tick_ + 1));
+        ++pending_;
+        id = (node.generation << kTimerSlotBits) | slot;
     }
+    if(earlier && this == timer_manager) {
+        RearmBSPTimer();
+    }
+    return id;
+}
 
-    return task_timer_timeout;
+Error TimerManager::CancelTimer(uint64_t id) {
+    SpinLockGuard guard{lock_};
+    auto node = FindNode(id);
+    if(node == nullptr) {
+        return MAKE_ERROR(Error::kNoSuchTimer);
+    }
+    Unlink(node->link);
+    FreeNode(*node);
+    return MAKE_ERROR(Error::kSuccess);
 }
 
-TimerManager::TimerManager() {
-    timers_.push(Timer{std::numeric_limits<unsigned long>::max(), -1}); 
+Error TimerManager::ModifyTimer(uint64_t id, unsigned long timeout) {
+    bool earlier;
+    {
+        SpinLockGuard guard{lock_};
+        auto node = FindNode(id);
+        if(node == nullptr) {
+            return MAKE_ERROR(Error::kNoSuchTimer);
+        }
+        Unlink(node->link);
+        node->timer = Timer{timeout, node->timer.Value(), node->timer.TaskID()};
+        earlier = UpdateNextEvent(Place(*node, tick_ + 1));
+    }
+    if(earlier && this == timer_manager) {
+        RearmBSPTimer();
+    }
+    return MAKE_ERROR(Error::kSuccess);
 }
 
-void TimerManager::AddTimer(const Timer& timer) {
-    timers_.push(timer);
+// lock_ を取った状態で呼ぶ。next_event_ が早まったら true
+bool TimerManager::UpdateNextEvent(unsigned long event) {
+    if(event >= next_event_.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    next_event_.store(event, std::memory_order_relaxed);
+    return true;
 }
 
-Timer::Timer(unsigned long timeout, int value) : timeout_{timeout}, value_{value} {
+Timer::Timer(unsigned long timeout, int value, uint64_t task_id)
+    : timeout_{timeout}, value_{value}, task_id_{task_id} {
 }
 
 void LAPICTimerOnInterrupt() {
-    const bool task_timer_timeout = timer_manager->Tick();
+    const int cpu = CurrentCPU();
+    const unsigned long interrupts = ++cpus[cpu].ticks;
+
+    // タイマの管理は BSP だけで行う
+    if(!tickless) {
+        if(cpu == 0) {
+            timer_manager->AdvanceTo(timer_manager->CurrentTick() + kPeriodicTicks);
+        }
+        NotifyEndOfInterrupt();
+        if(interrupts % (kTaskTimerPeriod / kPeriodicTicks) == 0) {
+            task_manager->SwitchTask();
+        }
+        return;
+    }
+
+    const uint64_t now = ReadTSC();
+    if(cpu == 0) {
+        timer_manager->AdvanceTo(TickOf(now));
+    }
+    const uint64_t slice_end = cpus[cpu].slice_end;
+    const bool slice_expired = slice_end != 0 && now >= slice_end;
+    if(!slice_expired) {
+        ArmLAPICTimer(now); // 切り替えるなら SwitchTask の中で StartTimeSlice が設定する
+    }
     NotifyEndOfInterrupt();
 
-    if(task_timer_timeout) {
+    if(slice_expired) {
         task_manager->SwitchTask();
     }
 }
 
+void HPETTimerOnInterrupt() {
+    AckHPETEvent();
+    if(tickless && CurrentCPU() == 0) {
+        const uint64_t now = ReadTSC();
+        timer_manager->AdvanceTo(TickOf(now));
+        ArmLAPICTimer(now);
+    }
+    NotifyEndOfInterrupt();
+}
+
+Error UseHPETEvents(bool enable) {
+    if(!tickless || CurrentCPU() != 0) {
+        return MAKE_ERROR(Error::kNotImplemented);
+    }
+    if(enable && !hpet_routed) {
+        if(auto err = StartHPETEvents(LocalAPICID(), InterruptVector::kHPETTimer)) {
+            return err;
+        }
+        hpet_routed = true;
+    }
+
+    InterruptGuard guard;
+    if(!enable && hpet_routed) {
+        StopHPETEvent();
+    }
+    hpet_events = enable;
+    ArmLAPICTimer(ReadTSC());
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+bool HPETEventsEnabled() {
+    return hpet_events;
+}
+
+void StartTimeSlice(bool busy) {
+    if(!tickless) {
+        return;
+    }
+    const uint64_t now = ReadTSC();
+    cpus[CurrentCPU()].slice_end = busy ? now + tsc_per_slice : 0;
+    ArmLAPICTimer(now);
+}
+
 void InitializeLAPICTimer() {
     timer_manager = new TimerManager;
     divide_config = 0b1011;
     lvt_timer = (0b001 << 16); // 単発モード、割り込み禁止
  
-    // APICタイマの周波数を計測
+    // APICタイマの周波数を、較正済みの TSC と比べて計測（10 ミリ秒）
+    const uint64_t tsc_start = ReadTSC();
     StartLAPICTimer();
-    acpi::WaitMillseconds(100);
+    while(ReadTSC() - tsc_start < tsc_freq / 100);
     const auto elapsed = LAPICTimerElapsed();
+    const uint64_t tsc_elapsed = ReadTSC() - tsc_start;
     StopLAPICTimer();
     
-    lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+    lapic_timer_freq = static_cast<unsigned long>(elapsed) * tsc_freq / tsc_elapsed;
+
+    // TSC が一定の速さで進むなら、TSC でティックを数えられる
+    tickless = TSCInvariant();
+    uint32_t eax, ebx, ecx, edx;
+    ReadCPUID(1, 0, &eax, &ebx, &ecx, &edx);
+    tsc_deadline = (ecx >> 24) & 1;
+
+    tsc_per_tick = tsc_freq / kTimerFreq;
+    tsc_per_slice = tsc_per_tick * kTaskTimerPeriod;
+    tsc_base = ReadTSC();
+    StartLAPICTimerInterrupt();
 
+    // ARAT（CPUID 6 EAX bit 2）がなければ、Local APIC タイマは深い省電力状態で止まる。
+    // idle でも期限を知らせる必要があるのは BSP のタイマだけなので、それを HPET に任せる
+    ReadCPUID(6, 0, &eax, &ebx, &ecx, &edx);
+    if(tickless && (eax & (1u << 2)) == 0 && HPETAvailable()) {
+        if(auto err = UseHPETEvents(true)) {
+            Log(kWarn, "failed to use HPET for timer events: %s at %s:%d\n",
+                err.Name(), err.File(), err.Line());
+        }
+    }
+}
+
+void StartLAPICTimerInterrupt() {
     divide_config = 0b1011;
-    lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer;  // 周期モード、割り込み許可
-    initial_count = lapic_timer_freq / kTimerFreq; // 10ミリ秒毎に割り込みが発生するように設定
+    if(!tickless) {
+        lvt_timer = kLVTPeriodic | InterruptVector::kLAPICTimer;  // 周期モード、割り込み許可
+        initial_count = lapic_timer_freq / kTimerFreq * kPeriodicTicks; // 10ミリ秒毎に割り込みが発生するように設定
+        return;
+    }
+
+    lvt_timer = (tsc_deadline ? kLVTTSCDeadline : kLVTOneShot) | InterruptVector::kLAPICTimer;
+    __asm__ volatile("mfence" ::: "memory"); // LVT の書き込みを IA32_TSC_DEADLINE より先に
+    // 実行中のタスクにも時間切れを設ける。AP の idle タスクなら最初の時間切れで止まる
+    InterruptGuard guard;
+    StartTimeSlice(true);
 }
 
 void StartLAPICTimer() {
@@ -1,42 +1,115 @@
 #pragma once
 #include <message.hpp>
-#include <queue>
+#include <array>
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
+#include <limits>
+#include "error.hpp"
+#include "spinlock.hpp"
 
 class Timer {
     public:
-        Timer(unsigned long timeout, int value);
+        Timer() = default;
+        Timer(unsigned long timeout, int value, uint64_t task_id);
         unsigned long Timeout() const { return timeout_; }
         int Value() const { return value_; }
+        uint64_t TaskID() const { return task_id_; }
     private:
-        unsigned long timeout_; // タイムアウト時間
-        int value_; // 通知用の値
+        unsigned long timeout_{0}; // タイムアウト時間
+        int value_{0}; // 通知用の値
+        uint64_t task_id_{0}; // 持ち主。kTimerTimeout を送る（value が kTaskWakeupValue なら起こすだけ）
 };
 
-inline bool operator<(const Timer& lhs, const Timer& rhs) {
-    return lhs.Timeout() > rhs.Timeout(); // timeoutが近いタイマを優先する
-}
+// タイマの ID は (世代 << kTimerSlotBits) | スロット番号。0 はどのタイマも指さない。
+// 発火・取り消しのたびに世代を進めるので、古い ID で別のタイマを消すことはない
+const int kTimerSlotBits = 13;
+const size_t kMaxTimers = static_cast<size_t>(1) << kTimerSlotBits;
 
+// 階層型タイミングホイール。レベル k のスロットは 64^k ティック分の期限を受け持ち、
+// そのスロットの時刻が来ると中のタイマを下のレベルに振り分け直す。
+// 追加・取り消しは O(1)、Tick は振り分けが起きない限り期限の来たタイマの数だけかかる
 class TimerManager {
     public:
+        static const int kWheelBits = 6;
+        static const int kWheelSlots = 1 << kWheelBits;
+        static const int kWheelLevels = 4; // 64^4 ティック（1kHz で約 4.6 時間）より先は何度か振り分け直す
+        static const unsigned long kNoEvent = std::numeric_limits<unsigned long>::max();
+
         TimerManager();
-        void AddTimer(const Timer& timer);
-        bool Tick();
-        unsigned long CurrentTick() const { return tick_; }
+        // タスクからも割り込みハンドラからも呼べる。
+        // 過ぎた期限は次のティックで発火する。タイマが足りなければ 0 を返す
+        uint64_t AddTimer(const Timer& timer);
+        // まだ発火していなければ取り消す。発火済み・取り消し済みなら kNoSuchTimer
+        Error CancelTimer(uint64_t id);
+        // まだ発火していなければ期限を timeout に変える
+        Error ModifyTimer(uint64_t id, unsigned long timeout);
+        // ティックを tick まで進め、期限の来たタイマを発火する。
+        // 空のスロットしかない区間は 1 ティックずつ進めずに飛ばす
+        void AdvanceTo(unsigned long tick);
+        void Tick() { AdvanceTo(tick_ + 1); }
+        // tickless では tick_ は BSP のタイマ割り込みでしか進まないので、TSC から求める
+        unsigned long CurrentTick() const;
+        // 次にスロットを処理する必要のあるティック（上のレベルの振り分けを含む）。なければ kNoEvent。
+        // ロックを取らないので、取り消したタイマの分だけ早いことがある
+        unsigned long NextEvent() const { return next_event_.load(std::memory_order_relaxed); }
+        size_t PendingTimers() const { return pending_; }
+        LockStats LockContention() const { return lock_.Stats(); }
     private:
+        struct Link {
+            Link* prev;
+            Link* next;
+        };
+        struct TimerNode {
+            Link link{nullptr, nullptr}; // 先頭に置く（Link* から TimerNode* に戻すため）。空きなら nullptr
+            Timer timer;
+            uint64_t generation{0};
+            uint32_t next_free{0}; // 空きスロットのリスト。0 は終端
+        };
+
+        SpinLock lock_; // 以下を守る
         volatile unsigned long tick_{0};
-        std::priority_queue<Timer> timers_{};
+        size_t pending_{0};
+        std::atomic<unsigned long> next_event_{kNoEvent};
+        std::array<std::array<Link, kWheelSlots>, kWheelLevels> wheel_;
+        std::array<TimerNode, kMaxTimers> nodes_; // スロット 0 は使わない
+        uint32_t free_node_{0};
+        uint32_t unused_node_{1}; // これ以降のスロットは一度も使われていない
+
+        TimerNode* FindNode(uint64_t id);
+        unsigned long Place(TimerNode& node, unsigned long earliest);
+        unsigned long FindNextEvent() const;
+        bool UpdateNextEvent(unsigned long event);
+        void ProcessTick();
+        void Cascade(int level);
+        void FireExpired(Link* expired);
+        void FreeNode(TimerNode& node);
+        static void Unlink(Link& link);
+        static Link* Detach(Link& head);
 };
 
 extern TimerManager* timer_manager;
 extern unsigned long lapic_timer_freq;  // APICタイマの1秒間あたりのカウント数(周波数)
-const int kTimerFreq = 100;
-const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);  // タスクの切り替え周期
-const int kTaskTimerValue = std::numeric_limits<int>::min();
+// true なら Local APIC タイマを周期モードで使わず、次の期限（BSP のタイマ・時間切れ）に
+// 合わせて 1 回ずつ鳴らす。TSC が一定の速さで進む CPU だけ
+extern bool tickless;
+const int kTimerFreq = 1000; // 1 ティック 1 ミリ秒
+const int kTaskTimerPeriod = kTimerFreq / 50;  // タスクの切り替え周期（20 ミリ秒）
+const int kPeriodicTicks = kTimerFreq / 100;   // tickless でないときの割り込み 1 回分のティック数
+const int kTaskWakeupValue = std::numeric_limits<int>::min() + 1; // メッセージを送らずタスクを起こす
 
 
 void LAPICTimerOnInterrupt();
 void InitializeLAPICTimer();
+// 計測済みの周波数で周期割り込みを始める。AP では各 CPU が自分で呼ぶ
+void StartLAPICTimerInterrupt();
+// この CPU の時間切れの期限を決め直す（busy なら今から kTaskTimerPeriod 後、でなければなし）。
+// タスクを切り替えるときに割り込み禁止で呼ぶ。tickless でなければ何もしない
+void StartTimeSlice(bool busy);
+void HPETTimerOnInterrupt();
+// tickless のとき、BSP のタイマの期限を Local APIC タイマでなく HPET で知らせる。BSP で呼ぶ
+Error UseHPETEvents(bool enable);
+bool HPETEventsEnabled();
 void StartLAPICTimer();
 uint32_t LAPICTimerElapsed();
 void StopLAPICTimer();
\ No newline at end of file
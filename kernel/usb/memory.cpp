@@ -1,43 +1,202 @@
 #include "usb/memory.hpp"
 
+#include <algorithm>
+#include <array>
 #include <cstdint>
+#include <cstring>
+#include "memory_manager.hpp"
 
 namespace {
-  template <class T>
-  T Ceil(T value, unsigned int alignment) {
-    return (value + alignment - 1) & ~static_cast<T>(alignment - 1);
+  /** @brief 最小ブロックは 64 バイト，最大ブロックはアリーナ全体 */
+  const int kMinOrder = 6;
+  const int kMaxOrder = 17;
+  static_assert((1ul << kMaxOrder) == usb::kMemoryPoolSize);
+  const size_t kBlocksPerArena = usb::kMemoryPoolSize >> kMinOrder;
+
+  /** @brief block_state の値．ブロック先頭以外は kNotHead． */
+  const uint8_t kNotHead = 0;
+  const uint8_t kFreeFlag = 0x80;
+
+  /** @brief アリーナ：サイズ kMemoryPoolSize で，同じサイズにアラインされた領域 */
+  struct Arena {
+    uintptr_t base;
+    std::array<uint8_t, kBlocksPerArena> block_state;  // order | kFreeFlag
+  };
+
+  struct FreeBlock {
+    FreeBlock* prev;
+    FreeBlock* next;
+  };
+
+  const int kMaxArenas = 16;
+  std::array<Arena, kMaxArenas> arenas;
+  int num_arenas = 0;
+  std::array<FreeBlock*, kMaxOrder + 1> free_lists{};
+
+  size_t bytes_in_use = 0;
+  size_t high_water_mark = 0;
+
+  int OrderOf(size_t bytes) {
+    int order = kMinOrder;
+    while ((static_cast<size_t>(1) << order) < bytes) {
+      ++order;
+    }
+    return order;
+  }
+
+  Arena* FindArena(uintptr_t addr) {
+    for (int i = 0; i < num_arenas; ++i) {
+      if (arenas[i].base <= addr && addr < arenas[i].base + usb::kMemoryPoolSize) {
+        return &arenas[i];
+      }
+    }
+    return nullptr;
+  }
+
+  uint8_t& StateOf(Arena& arena, uintptr_t block) {
+    return arena.block_state[(block - arena.base) >> kMinOrder];
+  }
+
+  void Push(Arena& arena, uintptr_t block, int order) {
+    auto node = reinterpret_cast<FreeBlock*>(block);
+    node->prev = nullptr;
+    node->next = free_lists[order];
+    if (node->next) {
+      node->next->prev = node;
+    }
+    free_lists[order] = node;
+    StateOf(arena, block) = order | kFreeFlag;
+  }
+
+  void Remove(Arena& arena, uintptr_t block, int order) {
+    auto node = reinterpret_cast<FreeBlock*>(block);
+    if (node->prev) {
+      node->prev->next = node->next;
+    } else {
+      free_lists[order] = node->next;
+    }
+    if (node->next) {
+      node->next->prev = node->prev;
+    }
+    StateOf(arena, block) = kNotHead;
+  }
+
+  bool AddArena(uintptr_t base) {
+    if (num_arenas == kMaxArenas) {
+      return false;
+    }
+    auto& arena = arenas[num_arenas++];
+    arena.base = base;
+    arena.block_state.fill(kNotHead);
+    Push(arena, base, kMaxOrder);
+    return true;
   }
 
-  template <class T, class U>
-  T MaskBits(T value, U mask) {
-    return value & ~static_cast<T>(mask - 1);
+  /** @brief フレームマネージャからアリーナを 1 つ追加する．
+   *
+   * ブロックの自然なアライメントを保つため，アリーナのサイズにアラインした
+   * 範囲だけを残し，前後の余りのフレームは返却する．
+   */
+  bool GrowPool() {
+    if (memory_manager == nullptr || num_arenas == kMaxArenas) {
+      return false;
+    }
+    const size_t arena_frames = usb::kMemoryPoolSize / kBytesPerFrame;
+    const auto frames = memory_manager->Allocate(arena_frames * 2);
+    if (frames.error) {
+      return false;
+    }
+
+    const size_t begin = frames.value.ID();
+    const size_t aligned = (begin + arena_frames - 1) & ~(arena_frames - 1);
+    if (aligned > begin) {
+      memory_manager->Free(FrameID{begin}, aligned - begin);
+    }
+    const size_t tail = aligned + arena_frames;
+    if (tail < begin + arena_frames * 2) {
+      memory_manager->Free(FrameID{tail}, begin + arena_frames * 2 - tail);
+    }
+    return AddArena(reinterpret_cast<uintptr_t>(FrameID{aligned}.Frame()));
   }
 }
 
 namespace usb {
-  alignas(64) uint8_t memory_pool[kMemoryPoolSize];
-  uintptr_t alloc_ptr = reinterpret_cast<uintptr_t>(memory_pool);
+  alignas(kMemoryPoolSize) uint8_t memory_pool[kMemoryPoolSize];
 
   void* AllocMem(size_t size, unsigned int alignment, unsigned int boundary) {
+    if (num_arenas == 0) {
+      AddArena(reinterpret_cast<uintptr_t>(memory_pool));
+    }
+
+    // 2^order のブロックは 2^order にアラインされるので，
+    // size <= boundary なら boundary を跨ぐことはない
+    int order = OrderOf(size);
     if (alignment > 0) {
-      alloc_ptr = Ceil(alloc_ptr, alignment);
+      order = std::max(order, OrderOf(alignment));
     }
-    if (boundary > 0) {
-      auto next_boundary = Ceil(alloc_ptr, boundary);
-      if (next_boundary < alloc_ptr + size) {
-        alloc_ptr = next_boundary;
+    if (order > kMaxOrder) {
+      return nullptr;
+    }
+
+    int found = order;
+    while (true) {
+      while (found <= kMaxOrder && free_lists[found] == nullptr) {
+        ++found;
       }
+      if (found <= kMaxOrder) {
+        break;
+      }
+      if (!GrowPool()) {
+        return nullptr;
+      }
+      found = order;
     }
 
-    if (reinterpret_cast<uintptr_t>(memory_pool) + kMemoryPoolSize
-        < alloc_ptr + size) {
-      return nullptr;
+    const auto block = reinterpret_cast<uintptr_t>(free_lists[found]);
+    auto& arena = *FindArena(block);
+    Remove(arena, block, found);
+    while (found > order) {
+      --found;
+      Push(arena, block + (static_cast<uintptr_t>(1) << found), found);
     }
+    StateOf(arena, block) = order;
 
-    auto p = alloc_ptr;
-    alloc_ptr += size;
-    return reinterpret_cast<void*>(p);
+    bytes_in_use += static_cast<size_t>(1) << order;
+    high_water_mark = std::max(high_water_mark, bytes_in_use);
+    // 呼び出し側は，以前のバンプアロケータ（.bss）と同じくゼロ埋めされていることを前提にしている
+    // （コンストラクタを呼ばずに使う Ring など）
+    memset(reinterpret_cast<void*>(block), 0, size);
+    return reinterpret_cast<void*>(block);
   }
 
-  void FreeMem(void* p) {}
+  void FreeMem(void* p) {
+    auto block = reinterpret_cast<uintptr_t>(p);
+    auto arena = FindArena(block);
+    if (arena == nullptr || (block & ((1u << kMinOrder) - 1)) != 0) {
+      return;
+    }
+    int order = StateOf(*arena, block);
+    if (order == kNotHead || (order & kFreeFlag)) {
+      return;
+    }
+    bytes_in_use -= static_cast<size_t>(1) << order;
+
+    // バディが空いていれば結合する
+    while (order < kMaxOrder) {
+      const auto buddy = arena->base +
+        ((block - arena->base) ^ (static_cast<uintptr_t>(1) << order));
+      if (StateOf(*arena, buddy) != (order | kFreeFlag)) {
+        break;
+      }
+      Remove(*arena, buddy, order);
+      StateOf(*arena, block) = kNotHead;
+      block = std::min(block, buddy);
+      ++order;
+    }
+    Push(*arena, block, order);
+  }
+
+  MemoryStat GetMemoryStat() {
+    return {num_arenas * kMemoryPoolSize, bytes_in_use, high_water_mark};
+  }
 }
@@ -2,6 +2,9 @@
  * @file usb/memory.hpp
  *
  * USB ドライバ用の動的メモリ管理機能
+ *
+ * メモリプールをバディシステムで管理する．プールが足りなくなると
+ * フレームマネージャから同じサイズの領域を追加する．
  */
 
 #pragma once
@@ -9,7 +12,7 @@
 #include <cstddef>
 
 namespace usb {
-  /** @brief 動的メモリ確保のためのメモリプールの最大容量（バイト） */
+  /** @brief メモリプール 1 つあたりの容量（バイト）．1 回に確保できる最大サイズでもある． */
   static const size_t kMemoryPoolSize = 4096 * 32;
 
   /** @brief 指定されたバイト数のメモリ領域を確保して先頭ポインタを返す．
@@ -17,6 +20,7 @@ namespace usb {
    * 先頭アドレスが alignment に揃ったメモリ領域を確保する．
    * size <= boundary ならメモリ領域が boundary を跨がないことを保証する．
    * boundary は典型的にはページ境界を跨がないように 4096 を指定する．
+   * 確保した領域は 0 で埋められている．
    *
    * @param size        確保するメモリ領域のサイズ（バイト単位）
    * @param alignment   メモリ領域のアライメント制約．0 なら制約しない．
@@ -31,9 +35,18 @@ namespace usb {
         AllocMem(sizeof(T) * num_obj, alignment, boundary));
   }
 
-  /** @brief 指定されたメモリ領域を解放する．本当に解放することは保証されない． */
+  /** @brief AllocMem で確保したメモリ領域を解放する． */
   void FreeMem(void* p);
 
+  struct MemoryStat {
+    size_t pool_bytes;       // メモリプールの合計容量
+    size_t bytes_in_use;     // 確保中のブロックの合計サイズ
+    size_t high_water_mark;  // bytes_in_use の最大値
+  };
+
+  /** @brief メモリプールの使用状況を返す． */
+  MemoryStat GetMemoryStat();
+
   /** @brief 標準コンテナ用のメモリアロケータ */
   template <class T, unsigned int Alignment = 64, unsigned int Boundary = 4096>
   class Allocator {
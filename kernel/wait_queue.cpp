@@ -0,0 +1,93 @@
+#include "wait_queue.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+void WaitQueue::Enqueue(Waiter& waiter) {
+    SpinLockGuard guard{lock_};
+    waiter.task = &task_manager->CurrentTask();
+    waiter.woken.store(false, std::memory_order_relaxed);
+    waiter.queued = true;
+    waiter.prev = tail_;
+    waiter.next = nullptr;
+    if(tail_) {
+        tail_->next = &waiter;
+    }
+    else {
+        head_ = &waiter;
+    }
+    tail_ = &waiter;
+}
+
+void WaitQueue::Dequeue(Waiter& waiter) {
+    SpinLockGuard guard{lock_};
+    if(!waiter.queued) {
+        return;
+    }
+    if(waiter.prev) {
+        waiter.prev->next = waiter.next;
+    }
+    else {
+        head_ = waiter.next;
+    }
+    if(waiter.next) {
+        waiter.next->prev = waiter.prev;
+    }
+    else {
+        tail_ = waiter.prev;
+    }
+    waiter.queued = false;
+}
+
+// lock_ を取った状態で呼ぶ。待つ側は Dequeue でロックを待つので、
+// ロックを外すまでは waiter が消えることはない
+void WaitQueue::WakeLocked(Waiter& waiter) {
+    head_ = waiter.next;
+    if(head_) {
+        head_->prev = nullptr;
+    }
+    else {
+        tail_ = nullptr;
+    }
+    waiter.queued = false;
+    waiter.woken.store(true, std::memory_order_release);
+    task_manager->Wakeup(waiter.task);
+}
+
+void WaitQueue::WakeOne() {
+    SpinLockGuard guard{lock_};
+    if(head_) {
+        WakeLocked(*head_);
+    }
+}
+
+void WaitQueue::WakeAll() {
+    SpinLockGuard guard{lock_};
+    while(head_) {
+        WakeLocked(*head_);
+    }
+}
+
+uint64_t WaitQueue::ArmTimeout(unsigned long deadline) {
+    if(deadline == kWaitForever) {
+        return 0;
+    }
+    return timer_manager->AddTimer(Timer{deadline, kTaskWakeupValue, task_manager->CurrentTask().ID()});
+}
+
+// 取り消す前に発火していても構わない。届いた Wakeup は次の Sleep が読み捨てる
+void WaitQueue::DisarmTimeout(uint64_t timer) {
+    if(timer != 0) {
+        timer_manager->CancelTimer(timer);
+    }
+}
+
+bool WaitQueue::Expired(unsigned long deadline) {
+    return deadline != kWaitForever && timer_manager->CurrentTick() >= deadline;
+}
+
+// Sleep は条件と関係のない Wakeup でも戻るので、起こされるか期限が来るまで眠り直す
+void WaitQueue::Block(Waiter& waiter, unsigned long deadline) {
+    while(!waiter.woken.load(std::memory_order_acquire) && !Expired(deadline)) {
+        waiter.task->Sleep();
+    }
+}
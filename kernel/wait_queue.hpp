@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include "spinlock.hpp"
+
+class Task;
+
+// WaitUntil / WaitMessage で期限を設けない
+const unsigned long kWaitForever = std::numeric_limits<unsigned long>::max();
+
+// 条件が成り立つのを待つタスクの列。条件を成り立たせた側が WakeOne / WakeAll で起こす。
+// 待つ側は列に入ってから条件を確かめるので、その間に起こされても取りこぼさない。
+class WaitQueue {
+    public:
+        // ready() が真になるか、タイマのカウントが deadline に達するまで眠る。
+        // ready() が真になったら true、期限切れなら false。タスクの文脈からだけ呼ぶ
+        template<typename Pred>
+        bool WaitUntil(Pred ready, unsigned long deadline);
+        template<typename Pred>
+        void Wait(Pred ready) { WaitUntil(ready, kWaitForever); }
+
+        void WakeOne();
+        void WakeAll();
+
+    private:
+        // 待っているタスクのスタック上に置く
+        struct Waiter {
+            Task* task;
+            Waiter* prev;
+            Waiter* next;
+            bool queued;
+            std::atomic<bool> woken;
+        };
+
+        SpinLock lock_;
+        Waiter* head_{nullptr};
+        Waiter* tail_{nullptr};
+
+        void Enqueue(Waiter& waiter);
+        void Dequeue(Waiter& waiter);
+        void WakeLocked(Waiter& waiter);
+        // 期限を設けなければ 0
+        static uint64_t ArmTimeout(unsigned long deadline);
+        static void DisarmTimeout(uint64_t timer);
+        static bool Expired(unsigned long deadline);
+        static void Block(Waiter& waiter, unsigned long deadline);
+};
+
+template<typename Pred>
+bool WaitQueue::WaitUntil(Pred ready, unsigned long deadline) {
+    Waiter waiter{};
+    const uint64_t timer = ArmTimeout(deadline);
+    while(true) {
+        Enqueue(waiter);
+        if(ready()) {
+            Dequeue(waiter);
+            DisarmTimeout(timer);
+            return true;
+        }
+        if(Expired(deadline)) {
+            Dequeue(waiter);
+            DisarmTimeout(timer);
+            return false;
+        }
+        Block(waiter, deadline);
+        Dequeue(waiter);
+    }
+}